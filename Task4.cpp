@@ -7,63 +7,6052 @@
 #include <algorithm>
 #include <iomanip>
 #include <cstdlib>
-#include <ctime>
+#include <deque>
+#include <unordered_set>
+#include <unordered_map>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#define SCRAPER_HAVE_MMAP 1
+#endif
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <memory>
+#include <memory_resource>
+#include <chrono>
+#include <stdexcept>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 using namespace std;
 
+// Heap allocation counters for --bench and --metrics. Only builds with
+// -DSCRAPER_COUNT_ALLOCATIONS fill them, by replacing the global operator
+// new; other builds, and programs that embed this file, keep their own
+// allocator and report the counts as unavailable. Counting is off until a
+// benchmark or --metrics switches it on.
+namespace allocstats {
+#ifdef SCRAPER_COUNT_ALLOCATIONS
+    constexpr bool available = true;
+#else
+    constexpr bool available = false;
+#endif
+    atomic<bool> enabled{false};
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> bytes{0};
+    thread_local uint64_t threadCount = 0;   // this thread's share of count
+
+    inline void record(size_t size) {
+        if (enabled.load(memory_order_relaxed)) {
+            count.fetch_add(1, memory_order_relaxed);
+            bytes.fetch_add(size, memory_order_relaxed);
+            threadCount++;
+        }
+    }
+}
+
+#ifdef SCRAPER_COUNT_ALLOCATIONS
+void* operator new(size_t size) {
+    allocstats::record(size);
+    void* memory = malloc(size ? size : 1);
+    if (!memory) throw bad_alloc();
+    return memory;
+}
+
+#if !defined(_MSC_VER)
+void* operator new(size_t size, align_val_t alignment) {
+    allocstats::record(size);
+    size_t align = static_cast<size_t>(alignment);
+    void* memory = aligned_alloc(align, (max<size_t>(size, 1) + align - 1) / align * align);
+    if (!memory) throw bad_alloc();
+    return memory;
+}
+#endif
+
+// Kept out of line: GCC otherwise inlines free() into callers that still
+// see the library operator new and warns about a mismatched pair
+#if defined(__GNUC__)
+#define SCRAPER_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define SCRAPER_NOINLINE __declspec(noinline)
+#else
+#define SCRAPER_NOINLINE
+#endif
+
+SCRAPER_NOINLINE void operator delete(void* memory) noexcept { free(memory); }
+SCRAPER_NOINLINE void operator delete(void* memory, size_t) noexcept { free(memory); }
+#if !defined(_MSC_VER)
+SCRAPER_NOINLINE void operator delete(void* memory, align_val_t) noexcept { free(memory); }
+SCRAPER_NOINLINE void operator delete(void* memory, size_t, align_val_t) noexcept { free(memory); }
+#endif
+#endif
+
 // Structure to store product information
 struct Product {
     string name;
     string price;
     string rating;
     string url;
-    string description;
     
     Product() : rating("0.0") {}
     
-    Product(const string& n, const string& p, const string& r, const string& u, const string& d = "") 
-        : name(n), price(p), rating(r), url(u), description(d) {}
+    Product(const string& n, const string& p, const string& r, const string& u)
+        : name(n), price(p), rating(r), url(u) {}
+};
+
+// Currencies the price rules recognize
+enum class Currency : uint8_t {
+    Unknown,
+    USD,
+    INR,
+    EUR,
+    GBP
+};
+
+// A price in minor units (cents, paise...) of its currency
+struct Money {
+    int64_t minorUnits = 0;
+    Currency currency = Currency::Unknown;
+    bool valid = false;
+};
+
+// Defined with the other text helpers below
+Money parsePrice(string_view text);
+int32_t parseRating(string_view text);
+
+// Product whose fields borrow their text from elsewhere: the mapped input
+// document, or the ProductBatch that owns the rewritten strings. Price and
+// rating are also parsed once into numbers for sorting and filtering; the
+// text is kept so output shows exactly what the page said.
+struct ProductView {
+    string_view name;
+    string_view price;
+    string_view rating = "0.0";
+    string_view url;
+    Money amount;
+    int32_t ratingHundredths = 0;   // "4.5" -> 450
+
+    ProductView() = default;
+    ProductView(const Product& product)
+        : name(product.name), price(product.price), rating(product.rating), url(product.url) {
+        parseValues();
+    }
+
+    // Fill amount and ratingHundredths from the price and rating text
+    void parseValues() {
+        amount = parsePrice(price);
+        ratingHundredths = parseRating(rating);
+    }
+
+    Product toProduct() const {
+        return Product(string(name), string(price), string(rating), string(url));
+    }
+};
+
+// ---------------------------------------------------------------------------
+// HTML tokenizer
+//
+// Walks the document once and records every start/end tag as a token whose
+// offsets point back into the source buffer. Text between tags is not copied;
+// rules look at it through the offsets when they need it.
+// ---------------------------------------------------------------------------
+
+inline char lowerAscii(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+inline bool isHtmlSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool equalsIgnoreCase(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (lowerAscii(a[i]) != lowerAscii(b[i])) return false;
+    }
+    return true;
+}
+
+// Find needle in text ignoring ASCII case. Needle must already be lower-case.
+size_t findIgnoreCase(string_view text, string_view needle, size_t from = 0) {
+    if (needle.empty()) return from <= text.size() ? from : string_view::npos;
+    if (text.size() < needle.size()) return string_view::npos;
+    const char first = needle[0];
+    const char firstUpper = (first >= 'a' && first <= 'z') ? static_cast<char>(first - ('a' - 'A')) : first;
+    const size_t last = text.size() - needle.size();
+    for (size_t i = from; i <= last; i++) {
+        if (text[i] != first && text[i] != firstUpper) continue;
+        size_t j = 1;
+        while (j < needle.size() && lowerAscii(text[i + j]) == needle[j]) j++;
+        if (j == needle.size()) return i;
+    }
+    return string_view::npos;
+}
+
+// Currency named in a price, by whichever marker appears first
+inline Currency detectCurrency(string_view text) {
+    static const struct {
+        const char* marker;   // lower-case
+        Currency currency;
+    } markers[] = {
+        {"$", Currency::USD}, {"usd", Currency::USD}, {"₹", Currency::INR}, {"inr", Currency::INR},
+        {"rs.", Currency::INR}, {"€", Currency::EUR}, {"eur", Currency::EUR}, {"£", Currency::GBP},
+        {"gbp", Currency::GBP}
+    };
+    Currency found = Currency::Unknown;
+    size_t first = string_view::npos;
+    for (const auto& entry : markers) {
+        size_t at = findIgnoreCase(text, entry.marker);
+        if (at < first) {
+            first = at;
+            found = entry.currency;
+        }
+    }
+    return found;
+}
+
+inline const char* currencyCode(Currency currency) {
+    switch (currency) {
+        case Currency::USD: return "USD";
+        case Currency::INR: return "INR";
+        case Currency::EUR: return "EUR";
+        case Currency::GBP: return "GBP";
+        default: return "";
+    }
+}
+
+// Parse the first number in text as a fixed-point value with two decimals:
+// "1,099.5" -> 109950. Grouping commas are skipped and further decimals
+// rounded. Returns -1 when there is no number or it does not fit.
+inline int64_t parseHundredths(string_view text) {
+    size_t i = 0;
+    while (i < text.size() && !isDigit(text[i])) i++;
+    if (i == text.size()) return -1;
+    if (i > 0 && text[i - 1] == '.') i--;   // ".99"
+
+    int64_t whole = 0;
+    for (; i < text.size(); i++) {
+        char c = text[i];
+        if (isDigit(c)) {
+            if (whole > (INT64_MAX / 100 - 9) / 10) return -1;
+            whole = whole * 10 + (c - '0');
+        } else if (!(c == ',' && i + 1 < text.size() && isDigit(text[i + 1]))) {
+            break;
+        }
+    }
+
+    int64_t fraction = 0;
+    if (i + 1 < text.size() && text[i] == '.' && isDigit(text[i + 1])) {
+        int digits = 0;
+        for (i++; i < text.size() && isDigit(text[i]); i++, digits++) {
+            if (digits < 2) fraction = fraction * 10 + (text[i] - '0');
+            else if (digits == 2 && text[i] >= '5') fraction++;
+        }
+        if (digits == 1) fraction *= 10;
+    }
+    return whole * 100 + fraction;
+}
+
+// "$1,099.00" -> 109900 USD, "₹2,13,444" -> 21344400 INR, "Cost: 253" ->
+// 25300 with no currency
+Money parsePrice(string_view text) {
+    Money money;
+    int64_t hundredths = parseHundredths(text);
+    if (hundredths < 0) return money;
+    money.minorUnits = hundredths;
+    money.currency = detectCurrency(text);
+    money.valid = true;
+    return money;
+}
+
+// "4.5" -> 450; 0 when there is no rating
+int32_t parseRating(string_view text) {
+    int64_t hundredths = parseHundredths(text);
+    return hundredths < 0 || hundredths > INT32_MAX ? 0 : static_cast<int32_t>(hundredths);
+}
+
+struct HtmlToken {
+    enum Kind : uint8_t { Open, Close };
+
+    Kind kind = Open;
+    bool selfClosing = false;
+    size_t begin = 0;       // offset of '<'
+    size_t end = 0;         // offset one past '>'
+    size_t nameBegin = 0;
+    size_t nameLength = 0;
+    size_t match = SIZE_MAX;  // index of the matching Close token (Open tokens only)
+
+    string_view name(string_view source) const { return source.substr(nameBegin, nameLength); }
+    string_view attributes(string_view source) const {
+        size_t from = nameBegin + nameLength;
+        size_t to = end - (selfClosing ? 2 : 1);
+        return to > from ? source.substr(from, to - from) : string_view();
+    }
+};
+
+// Token lists usually live in a document's arena (see DocumentArena)
+using TokenList = pmr::vector<HtmlToken>;
+
+// Look up an attribute value inside the raw attribute text of a start tag.
+// Handles double-quoted, single-quoted and unquoted values.
+bool findAttribute(string_view attrs, string_view name, string_view& value) {
+    size_t i = 0;
+    while (i < attrs.size()) {
+        while (i < attrs.size() && (isHtmlSpace(attrs[i]) || attrs[i] == '/')) i++;
+        size_t nameStart = i;
+        while (i < attrs.size() && !isHtmlSpace(attrs[i]) && attrs[i] != '=' && attrs[i] != '/') i++;
+        string_view attrName = attrs.substr(nameStart, i - nameStart);
+        while (i < attrs.size() && isHtmlSpace(attrs[i])) i++;
+
+        string_view attrValue;
+        if (i < attrs.size() && attrs[i] == '=') {
+            i++;
+            while (i < attrs.size() && isHtmlSpace(attrs[i])) i++;
+            if (i < attrs.size() && (attrs[i] == '"' || attrs[i] == '\'')) {
+                char quote = attrs[i++];
+                size_t valueStart = i;
+                while (i < attrs.size() && attrs[i] != quote) i++;
+                attrValue = attrs.substr(valueStart, i - valueStart);
+                if (i < attrs.size()) i++;
+            } else {
+                size_t valueStart = i;
+                while (i < attrs.size() && !isHtmlSpace(attrs[i])) i++;
+                attrValue = attrs.substr(valueStart, i - valueStart);
+            }
+        }
+
+        if (!attrName.empty() && equalsIgnoreCase(attrName, name)) {
+            value = attrValue;
+            return true;
+        }
+        if (attrName.empty() && i == nameStart) i++;
+    }
+    return false;
+}
+
+class HtmlTokenizer {
+public:
+    // Tokenize the whole document and pair every start tag with its end tag.
+    static void tokenize(string_view html, TokenList& tokens) {
+        tokens.clear();
+        tokens.reserve(html.size() / 24);
+
+        const char* base = html.data();
+        size_t pos = 0;
+        while (pos < html.size()) {
+            const void* hit = memchr(base + pos, '<', html.size() - pos);
+            if (!hit) break;
+            size_t lt = static_cast<const char*>(hit) - base;
+            if (lt + 1 >= html.size()) break;
+
+            char next = html[lt + 1];
+            if (next == '!') {
+                // Comments, CDATA and doctype are skipped as a unit
+                size_t close = html.compare(lt, 4, "<!--") == 0 ? html.find("-->", lt + 4) : html.find('>', lt + 2);
+                if (close == string_view::npos) break;
+                pos = close + (html[close] == '>' ? 1 : 3);
+                continue;
+            }
+            if (next == '?') {
+                size_t close = html.find('>', lt + 2);
+                if (close == string_view::npos) break;
+                pos = close + 1;
+                continue;
+            }
+
+            bool closing = next == '/';
+            size_t nameStart = lt + (closing ? 2 : 1);
+            if (nameStart >= html.size() || !isTagNameStart(html[nameStart])) {
+                pos = lt + 1;
+                continue;
+            }
+            size_t nameEnd = nameStart;
+            while (nameEnd < html.size() && isTagNameChar(html[nameEnd])) nameEnd++;
+
+            size_t gt = findTagEnd(html, nameEnd);
+            if (gt == string_view::npos) break;
+
+            HtmlToken token;
+            token.kind = closing ? HtmlToken::Close : HtmlToken::Open;
+            token.begin = lt;
+            token.end = gt + 1;
+            token.nameBegin = nameStart;
+            token.nameLength = nameEnd - nameStart;
+            token.selfClosing = !closing && gt > nameEnd && html[gt - 1] == '/';
+            tokens.push_back(token);
+            pos = gt + 1;
+
+            // Script and style bodies are raw text; jump straight to their end tag
+            if (!closing && !token.selfClosing) {
+                string_view name = token.name(html);
+                if (equalsIgnoreCase(name, "script") || equalsIgnoreCase(name, "style")) {
+                    size_t close = pos;
+                    while ((close = html.find("</", close)) != string_view::npos) {
+                        if (equalsIgnoreCase(html.substr(close + 2, name.size()), name)) break;
+                        close += 2;
+                    }
+                    pos = close == string_view::npos ? html.size() : close;
+                }
+            }
+        }
+
+        pairTags(html, tokens);
+    }
+
+    static bool isTagNameStart(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool isTagNameChar(char c) {
+        return isTagNameStart(c) || isDigit(c) || c == '-' || c == ':' || c == '_';
+    }
+
+    // Find the '>' that ends a tag, skipping over quoted attribute values
+    static size_t findTagEnd(string_view html, size_t from) {
+        char quote = 0;
+        for (size_t pos = from; pos < html.size(); pos++) {
+            char c = html[pos];
+            if (quote) {
+                if (c == quote) quote = 0;
+            } else if (c == '"' || c == '\'') {
+                if (pos > 0 && html[pos - 1] == '=') quote = c;
+                else if (pos > 1 && html[pos - 1] == ' ' && html[pos - 2] == '=') quote = c;
+            } else if (c == '>') {
+                return pos;
+            }
+        }
+        // Unbalanced quote: fall back to the first '>' like a browser would
+        return html.find('>', from);
+    }
+
+private:
+    // Pair start and end tags with a stack. Unclosed elements keep match == SIZE_MAX,
+    // stray end tags are ignored.
+    static void pairTags(string_view html, TokenList& tokens) {
+        pmr::vector<size_t> open(tokens.get_allocator());
+        open.reserve(64);
+        for (size_t i = 0; i < tokens.size(); i++) {
+            HtmlToken& token = tokens[i];
+            if (token.kind == HtmlToken::Open) {
+                if (!token.selfClosing) open.push_back(i);
+                continue;
+            }
+            string_view name = token.name(html);
+            for (size_t depth = open.size(); depth > 0; depth--) {
+                if (equalsIgnoreCase(tokens[open[depth - 1]].name(html), name)) {
+                    tokens[open[depth - 1]].match = i;
+                    open.resize(depth - 1);
+                    break;
+                }
+            }
+        }
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Document tree and CSS selectors
+//
+// DomTree turns a token list into a flat element tree. It keeps one array
+// of nodes in document order and one array of attributes, and both hold
+// offsets into the source buffer. A node's descendants are the nodes right
+// after it, up to `end`, so a subtree is an index range and needs no child
+// lists. Both arrays come from the document arena, so building a tree
+// costs no allocation per node.
+//
+// CssSelector evaluates a subset of CSS over such a tree:
+//   - type (div, *), .class, #id
+//   - [attr], [attr=v], [attr~=v], [attr^=v], [attr$=v], [attr*=v]
+//   - the descendant and child (>) combinators
+//   - comma-separated lists
+// Like the rest of the rules, names and values ignore ASCII case.
+// ---------------------------------------------------------------------------
+
+class DomTree {
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    struct Node {
+        size_t begin = 0;            // '<' of the start tag; the name follows it
+        size_t innerBegin = 0;       // one past the start tag's '>'
+        size_t innerEnd = 0;         // '<' of the end tag; innerBegin when unclosed
+        uint32_t nameLength = 0;
+        uint32_t parent = kNone;
+        uint32_t end = 0;            // one past the last descendant
+        uint32_t firstAttribute = 0;
+        uint32_t attributeCount = 0;
+        bool closed = false;
+    };
+
+    // One attribute as offsets into the source; a bare attribute has an
+    // empty value
+    struct Attribute {
+        size_t nameBegin;
+        size_t valueBegin;
+        uint32_t nameLength;
+        uint32_t valueLength;
+    };
+
+    explicit DomTree(pmr::memory_resource* memory = pmr::get_default_resource())
+        : nodes(memory), attributes(memory), open(memory) {}
+
+    // Build the tree of `html` from its tokens (HtmlTokenizer::tokenize).
+    // Every start tag becomes a node. A start tag without a matching end
+    // tag gets no children, as in the token rules.
+    void build(string_view html, const TokenList& tokens) {
+        text = html;
+        nodes.clear();
+        attributes.clear();
+        open.clear();
+        nodes.reserve(tokens.size() / 2 + 1);
+        attributes.reserve(tokens.size() / 2 + 1);
+
+        for (size_t i = 0; i < tokens.size(); i++) {
+            closeThrough(i);
+            const HtmlToken& token = tokens[i];
+            if (token.kind != HtmlToken::Open) continue;
+
+            Node node;
+            node.begin = token.begin;
+            node.innerBegin = node.innerEnd = token.end;
+            node.nameLength = static_cast<uint32_t>(token.nameLength);
+            node.parent = open.empty() ? kNone : open.back().first;
+            node.firstAttribute = static_cast<uint32_t>(attributes.size());
+            string_view attrs = token.attributes(html);
+            parseAttributes(attrs, static_cast<size_t>(attrs.data() - html.data()));
+            node.attributeCount = static_cast<uint32_t>(attributes.size()) - node.firstAttribute;
+
+            uint32_t index = size();
+            if (token.match != SIZE_MAX) {
+                node.closed = true;
+                node.innerEnd = tokens[token.match].begin;
+                open.emplace_back(index, token.match);
+            } else {
+                node.end = index + 1;
+            }
+            nodes.push_back(node);
+        }
+        closeThrough(SIZE_MAX);
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(nodes.size()); }
+    const Node& node(uint32_t index) const { return nodes[index]; }
+    string_view source() const { return text; }
+
+    string_view name(uint32_t index) const {
+        return text.substr(nodes[index].begin + 1, nodes[index].nameLength);
+    }
+
+    // Markup between the start and the end tag
+    string_view inner(uint32_t index) const {
+        const Node& n = nodes[index];
+        return text.substr(n.innerBegin, n.innerEnd - n.innerBegin);
+    }
+
+    // First attribute called `attributeName` (lower-case)
+    bool attribute(uint32_t index, string_view attributeName, string_view& value) const {
+        const Node& n = nodes[index];
+        for (uint32_t a = n.firstAttribute; a < n.firstAttribute + n.attributeCount; a++) {
+            const Attribute& entry = attributes[a];
+            if (equalsIgnoreCase(text.substr(entry.nameBegin, entry.nameLength), attributeName)) {
+                value = text.substr(entry.valueBegin, entry.valueLength);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    string_view text;
+    pmr::vector<Node> nodes;
+    pmr::vector<Attribute> attributes;
+    // Elements still open while building: node and its end tag's token index
+    pmr::vector<pair<uint32_t, size_t>> open;
+
+    void closeThrough(size_t token) {
+        while (!open.empty() && open.back().second <= token) {
+            nodes[open.back().first].end = size();
+            open.pop_back();
+        }
+    }
+
+    // Same grammar as findAttribute, recording every attribute once
+    void parseAttributes(string_view attrs, size_t offset) {
+        size_t i = 0;
+        while (i < attrs.size()) {
+            while (i < attrs.size() && (isHtmlSpace(attrs[i]) || attrs[i] == '/')) i++;
+            size_t nameStart = i;
+            while (i < attrs.size() && !isHtmlSpace(attrs[i]) && attrs[i] != '=' && attrs[i] != '/') i++;
+            size_t nameLength = i - nameStart;
+            while (i < attrs.size() && isHtmlSpace(attrs[i])) i++;
+
+            size_t valueStart = i, valueLength = 0;
+            if (i < attrs.size() && attrs[i] == '=') {
+                i++;
+                while (i < attrs.size() && isHtmlSpace(attrs[i])) i++;
+                if (i < attrs.size() && (attrs[i] == '"' || attrs[i] == '\'')) {
+                    char quote = attrs[i++];
+                    valueStart = i;
+                    while (i < attrs.size() && attrs[i] != quote) i++;
+                    valueLength = i - valueStart;
+                    if (i < attrs.size()) i++;
+                } else {
+                    valueStart = i;
+                    while (i < attrs.size() && !isHtmlSpace(attrs[i])) i++;
+                    valueLength = i - valueStart;
+                }
+            }
+
+            if (nameLength > 0) {
+                attributes.push_back(Attribute{offset + nameStart, offset + valueStart,
+                                               static_cast<uint32_t>(nameLength), static_cast<uint32_t>(valueLength)});
+            }
+            if (nameLength == 0 && i == nameStart) i++;
+        }
+    }
+};
+
+class CssSelector {
+public:
+    CssSelector() = default;
+
+    // Parse a selector list such as "div.product-item, li.product > a".
+    // Throws runtime_error naming what could not be parsed.
+    static CssSelector parse(string_view selectorText) {
+        CssSelector selector;
+        selector.text = string(selectorText);
+        Parser parser{selectorText, 0};
+        parser.skipSpaces();
+        while (true) {
+            selector.alternatives.push_back(parser.complex());
+            if (parser.atEnd()) break;
+            parser.expect(',');
+            parser.skipSpaces();
+        }
+        return selector;
+    }
+
+    // The selector an element rule stands for: one of `tags` whose
+    // `attribute` contains `needles` in order, or equals needles[0] when
+    // `exact`. In-order substrings have no CSS spelling, so the rule is
+    // built directly.
+    static CssSelector element(const vector<string>& tags, const string& attribute,
+                               const vector<string>& needles, bool exact) {
+        CssSelector selector;
+        Compound compound;
+        compound.tags = tags;
+        AttributeTest test;
+        test.op = exact ? AttributeTest::Equals : AttributeTest::InOrder;
+        test.name = attribute;
+        test.values = needles;
+        compound.tests.push_back(move(test));
+        selector.alternatives.push_back(Complex{move(compound)});
+        return selector;
+    }
+
+    bool empty() const { return alternatives.empty(); }
+    const string& source() const { return text; }
+
+    bool matches(const DomTree& tree, uint32_t node) const {
+        for (const auto& complex : alternatives) {
+            if (matchesFrom(complex, complex.size() - 1, tree, node)) return true;
+        }
+        return false;
+    }
+
+    // First node in [from, to) that matches, or DomTree::kNone
+    uint32_t findFirst(const DomTree& tree, uint32_t from, uint32_t to) const {
+        for (uint32_t i = from; i < to; i++) {
+            if (matches(tree, i)) return i;
+        }
+        return DomTree::kNone;
+    }
+
+    // CSS specificity of the most specific alternative, as one number:
+    // 100 per id, 10 per class or attribute test, 1 per type
+    int specificity() const {
+        int best = 0;
+        for (const auto& complex : alternatives) {
+            int score = 0;
+            for (const auto& compound : complex) {
+                if (!compound.tags.empty()) score += 1;
+                for (const auto& test : compound.tests) {
+                    score += test.name == "id" && test.op == AttributeTest::Equals ? 100 : 10;
+                }
+            }
+            best = max(best, score);
+        }
+        return best;
+    }
+
+private:
+    struct AttributeTest {
+        enum Op : uint8_t {
+            Present,    // [attr]
+            Equals,     // [attr=v], #id
+            Word,       // [attr~=v], .class
+            Prefix,     // [attr^=v]
+            Suffix,     // [attr$=v]
+            Contains,   // [attr*=v]
+            InOrder     // element rules: every value, in order
+        };
+
+        Op op = Present;
+        string name;            // lower-case
+        vector<string> values;  // lower-case
+
+        bool matches(string_view value) const {
+            switch (op) {
+                case Present:
+                    return true;
+                case Equals:
+                    return equalsIgnoreCase(value, values[0]);
+                case Word: {
+                    size_t i = 0;
+                    while (i < value.size()) {
+                        while (i < value.size() && isHtmlSpace(value[i])) i++;
+                        size_t start = i;
+                        while (i < value.size() && !isHtmlSpace(value[i])) i++;
+                        if (i > start && equalsIgnoreCase(value.substr(start, i - start), values[0])) return true;
+                    }
+                    return false;
+                }
+                case Prefix:
+                    return value.size() >= values[0].size() &&
+                           equalsIgnoreCase(value.substr(0, values[0].size()), values[0]);
+                case Suffix:
+                    return value.size() >= values[0].size() &&
+                           equalsIgnoreCase(value.substr(value.size() - values[0].size()), values[0]);
+                case Contains:
+                    return findIgnoreCase(value, values[0]) != string_view::npos;
+                case InOrder: {
+                    size_t at = 0;
+                    for (const auto& needle : values) {
+                        at = findIgnoreCase(value, needle, at);
+                        if (at == string_view::npos) return false;
+                        at += needle.size();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // tag.class[attr]..., joined to the compound before it by whitespace
+    // or, when `child`, by '>'
+    struct Compound {
+        vector<string> tags;   // lower-case; empty matches any element
+        vector<AttributeTest> tests;
+        bool child = false;
+    };
+    using Complex = vector<Compound>;
+
+    vector<Complex> alternatives;
+    string text;
+
+    static bool matchesCompound(const Compound& compound, const DomTree& tree, uint32_t node) {
+        if (!compound.tags.empty()) {
+            string_view name = tree.name(node);
+            bool found = false;
+            for (const auto& tag : compound.tags) found = found || equalsIgnoreCase(name, tag);
+            if (!found) return false;
+        }
+        for (const auto& test : compound.tests) {
+            string_view value;
+            if (!tree.attribute(node, test.name, value) || !test.matches(value)) return false;
+        }
+        return true;
+    }
+
+    // Compounds are matched right to left, walking up the ancestors
+    static bool matchesFrom(const Complex& complex, size_t k, const DomTree& tree, uint32_t node) {
+        if (!matchesCompound(complex[k], tree, node)) return false;
+        if (k == 0) return true;
+        uint32_t ancestor = tree.node(node).parent;
+        if (complex[k].child) return ancestor != DomTree::kNone && matchesFrom(complex, k - 1, tree, ancestor);
+        for (; ancestor != DomTree::kNone; ancestor = tree.node(ancestor).parent) {
+            if (matchesFrom(complex, k - 1, tree, ancestor)) return true;
+        }
+        return false;
+    }
+
+    struct Parser {
+        string_view in;
+        size_t pos;
+
+        bool atEnd() const { return pos == in.size(); }
+
+        bool skipSpaces() {
+            size_t start = pos;
+            while (pos < in.size() && isHtmlSpace(in[pos])) pos++;
+            return pos > start;
+        }
+
+        [[noreturn]] void fail(const string& what) const {
+            throw runtime_error(what + " at '" + string(in.substr(pos)) + "' in selector '" + string(in) + "'");
+        }
+
+        void expect(char c) {
+            if (pos >= in.size() || in[pos] != c) fail(string("expected '") + c + "'");
+            pos++;
+        }
+
+        static bool isNameChar(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) || c == '-' || c == '_' ||
+                   static_cast<unsigned char>(c) >= 0x80;
+        }
+
+        string name() {
+            size_t start = pos;
+            while (pos < in.size() && isNameChar(in[pos])) pos++;
+            if (pos == start) fail("expected a name");
+            string result(in.substr(start, pos - start));
+            for (char& c : result) c = lowerAscii(c);
+            return result;
+        }
+
+        // A quoted string or a bare name
+        string value() {
+            if (pos < in.size() && (in[pos] == '"' || in[pos] == '\'')) {
+                char quote = in[pos++];
+                size_t end = in.find(quote, pos);
+                if (end == string_view::npos) fail("unterminated string");
+                string result(in.substr(pos, end - pos));
+                for (char& c : result) c = lowerAscii(c);
+                pos = end + 1;
+                return result;
+            }
+            return name();
+        }
+
+        AttributeTest attributeTest() {
+            AttributeTest test;
+            skipSpaces();
+            test.name = name();
+            skipSpaces();
+            if (pos < in.size() && in[pos] != ']') {
+                static const struct {
+                    const char* spelling;
+                    AttributeTest::Op op;
+                } operators[] = {
+                    {"=", AttributeTest::Equals}, {"~=", AttributeTest::Word}, {"^=", AttributeTest::Prefix},
+                    {"$=", AttributeTest::Suffix}, {"*=", AttributeTest::Contains}
+                };
+                bool known = false;
+                for (const auto& entry : operators) {
+                    size_t length = strlen(entry.spelling);
+                    if (in.compare(pos, length, entry.spelling) == 0) {
+                        test.op = entry.op;
+                        pos += length;
+                        known = true;
+                        break;
+                    }
+                }
+                if (!known) fail("unknown attribute operator");
+                skipSpaces();
+                test.values.push_back(value());
+                skipSpaces();
+            }
+            expect(']');
+            return test;
+        }
+
+        Compound compound() {
+            Compound result;
+            if (pos < in.size() && in[pos] == '*') {
+                pos++;
+            } else if (pos < in.size() && isNameChar(in[pos])) {
+                result.tags.push_back(name());
+            } else if (pos >= in.size() || (in[pos] != '.' && in[pos] != '#' && in[pos] != '[')) {
+                fail("expected a selector");
+            }
+            while (pos < in.size()) {
+                char c = in[pos];
+                if (c == '.' || c == '#') {
+                    pos++;
+                    AttributeTest test;
+                    test.op = c == '.' ? AttributeTest::Word : AttributeTest::Equals;
+                    test.name = c == '.' ? "class" : "id";
+                    test.values.push_back(name());
+                    result.tests.push_back(move(test));
+                } else if (c == '[') {
+                    pos++;
+                    result.tests.push_back(attributeTest());
+                } else {
+                    break;
+                }
+            }
+            return result;
+        }
+
+        Complex complex() {
+            Complex result;
+            result.push_back(compound());
+            while (true) {
+                bool spaced = skipSpaces();
+                if (atEnd() || in[pos] == ',') return result;
+                bool child = in[pos] == '>';
+                if (child) {
+                    pos++;
+                    skipSpaces();
+                } else if (!spaced) {
+                    fail("unexpected character");
+                }
+                result.push_back(compound());
+                result.back().child = child;
+            }
+        }
+    };
+};
+
+// ---------------------------------------------------------------------------
+// Extraction rules evaluated over the token stream
+// ---------------------------------------------------------------------------
+
+// Matches a start tag by name and by the substrings its attribute must contain,
+// in order. {"div"}, "class", {"product", "item"} is the token form of
+// <div[^>]*class="[^"]*product[^"]*item[^"]*"[^>]*>
+// Rules written as CSS keep only `selector`, which needs the document tree,
+// so they never match a bare token.
+struct TagRule {
+    vector<string> tags;       // lower-case tag names
+    string attribute;          // attribute to inspect
+    vector<string> needles;    // lower-case substrings, in order
+    bool exact = false;        // attribute must equal needles[0]
+    bool css = false;          // written as a CSS selector
+    CssSelector selector;      // the same rule as evaluated by the DOM engine
+
+    bool matches(string_view source, const HtmlToken& token) const {
+        if (css || token.kind != HtmlToken::Open) return false;
+        if (!matchesTag(token.name(source))) return false;
+
+        string_view value;
+        if (!findAttribute(token.attributes(source), attribute, value)) return false;
+        if (exact) return equalsIgnoreCase(value, needles[0]);
+
+        size_t at = 0;
+        for (const auto& needle : needles) {
+            at = findIgnoreCase(value, needle, at);
+            if (at == string_view::npos) return false;
+            at += needle.size();
+        }
+        return true;
+    }
+
+    bool matchesTag(string_view name) const {
+        for (const auto& tag : tags) {
+            if (equalsIgnoreCase(name, tag)) return true;
+        }
+        return false;
+    }
+
+    // How narrowly the rule selects elements; when container matches nest,
+    // the more specific one wins
+    int specificity() const {
+        if (css) return selector.specificity();
+        int score = exact ? 100 : 0;
+        for (const auto& needle : needles) score += static_cast<int>(needle.size());
+        return score;
+    }
+};
+
+// One entry in the name / price / rating tables. Element rules look at the
+// first element matching `element`; the text rules scan the raw container
+// markup the same way the old free-text regexes did.
+struct FieldRule {
+    enum Kind : uint8_t {
+        Element,         // <tag class="...">(.*?)</tag>
+        NumericElement,  // <tag class="...">([0-9.]+)</tag>
+        Amount,          // marker\s*[\d,]+\.?\d*      (whole match)
+        LabeledAmount,   // marker\s*([\d,]+\.?\d*)
+        LabeledNumber,   // marker\s*([0-9.]+)
+        OutOf,           // ([0-9.]+)\s*out\s*of\s*[0-9]+
+        Ratio,           // ([0-9.]+)\s*/\s*[0-9]+
+        Selector         // first element matching element.selector (DOM engine only)
+    };
+
+    Kind kind = Element;
+    TagRule element;
+    string marker;   // lower-case
+};
+
+// Token-rule tables, evaluated in order; see ExtractionRules
+struct TokenRuleSet {
+    vector<TagRule> containers;
+    vector<FieldRule> names;
+    vector<FieldRule> prices;
+    vector<FieldRule> ratings;
+
+    // Container rule indices grouped by tag name, so a start tag is only
+    // checked against the rules that can match it
+    vector<pair<string, vector<size_t>>> containerDispatch;
+
+    void buildDispatch() {
+        containerDispatch.clear();
+        for (size_t i = 0; i < containers.size(); i++) {
+            for (const auto& tag : containers[i].tags) {
+                auto entry = find_if(containerDispatch.begin(), containerDispatch.end(),
+                                     [&](const pair<string, vector<size_t>>& e) { return e.first == tag; });
+                if (entry == containerDispatch.end()) {
+                    containerDispatch.emplace_back(tag, vector<size_t>());
+                    entry = containerDispatch.end() - 1;
+                }
+                entry->second.push_back(i);
+            }
+        }
+    }
+
+    const vector<size_t>* containerRulesFor(string_view tag) const {
+        for (const auto& entry : containerDispatch) {
+            if (equalsIgnoreCase(tag, entry.first)) return &entry.second;
+        }
+        return nullptr;
+    }
+};
+
+// Attempts, hits and time spent in one rule; only updated while metrics
+// are enabled. A hit is a rule that supplied the field (or, for
+// containers, a container that held a product).
+struct RuleCounters {
+    atomic<uint64_t> attempts{0};
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> nanoseconds{0};
+
+    void attempt(chrono::steady_clock::time_point started) {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started);
+        attempts.fetch_add(1, memory_order_relaxed);
+        nanoseconds.fetch_add(static_cast<uint64_t>(elapsed.count()), memory_order_relaxed);
+    }
+
+    void hit() { hits.fetch_add(1, memory_order_relaxed); }
+};
+
+// Scanners for the free-text rules. Each returns the captured text (empty on
+// no match) using the same leftmost / greedy semantics as the regex versions.
+namespace textscan {
+
+inline bool isAmountChar(char c) { return isDigit(c) || c == ','; }
+inline bool isNumberChar(char c) { return isDigit(c) || c == '.'; }
+
+inline size_t skipSpaces(string_view text, size_t i) {
+    while (i < text.size() && isHtmlSpace(text[i])) i++;
+    return i;
+}
+
+// [\d,]+\.?\d* starting at i; returns end offset or i when nothing matched
+inline size_t scanAmount(string_view text, size_t i) {
+    size_t start = i;
+    while (i < text.size() && isAmountChar(text[i])) i++;
+    if (i == start) return start;
+    if (i < text.size() && text[i] == '.') i++;
+    while (i < text.size() && isDigit(text[i])) i++;
+    return i;
+}
+
+inline string_view amount(string_view text, string_view marker, bool includeMarker) {
+    size_t at = 0;
+    while ((at = findIgnoreCase(text, marker, at)) != string_view::npos) {
+        size_t digits = skipSpaces(text, at + marker.size());
+        size_t end = scanAmount(text, digits);
+        if (end != digits) {
+            size_t from = includeMarker ? at : digits;
+            return text.substr(from, end - from);
+        }
+        at++;
+    }
+    return string_view();
+}
+
+inline string_view labeledNumber(string_view text, string_view marker) {
+    size_t at = 0;
+    while ((at = findIgnoreCase(text, marker, at)) != string_view::npos) {
+        size_t start = skipSpaces(text, at + marker.size());
+        size_t end = start;
+        while (end < text.size() && isNumberChar(text[end])) end++;
+        if (end != start) return text.substr(start, end - start);
+        at++;
+    }
+    return string_view();
+}
+
+// ([0-9.]+) followed by `suffix`, where suffix reports whether the text after
+// the number completes the match
+template <typename Suffix>
+inline string_view numberBefore(string_view text, Suffix suffix) {
+    size_t i = 0;
+    while (i < text.size()) {
+        if (!isNumberChar(text[i])) { i++; continue; }
+        size_t start = i;
+        while (i < text.size() && isNumberChar(text[i])) i++;
+        if (suffix(text, i)) return text.substr(start, i - start);
+    }
+    return string_view();
+}
+
+inline bool followedByKeyword(string_view text, size_t& i, string_view keyword) {
+    i = skipSpaces(text, i);
+    if (text.size() - i < keyword.size()) return false;
+    if (!equalsIgnoreCase(text.substr(i, keyword.size()), keyword)) return false;
+    i += keyword.size();
+    return true;
+}
+
+inline bool followedByDigits(string_view text, size_t i) {
+    i = skipSpaces(text, i);
+    return i < text.size() && isDigit(text[i]);
+}
+
+inline string_view outOf(string_view text) {
+    return numberBefore(text, [](string_view t, size_t i) {
+        return followedByKeyword(t, i, "out") && followedByKeyword(t, i, "of") && followedByDigits(t, i);
+    });
+}
+
+inline string_view ratio(string_view text) {
+    return numberBefore(text, [](string_view t, size_t i) {
+        return followedByKeyword(t, i, "/") && followedByDigits(t, i);
+    });
+}
+
+} // namespace textscan
+
+// ---------------------------------------------------------------------------
+// Text cleaning and CSV escaping
+//
+// Single-pass replacements for the regex_replace chains. Both scan for the
+// few bytes they care about with SIMD (AVX2, SSE2, or a scalar loop) and copy
+// the runs in between as a block. Inputs that need no change are returned /
+// appended as-is, without touching the heap.
+// ---------------------------------------------------------------------------
+
+namespace simdscan {
+
+inline unsigned countTrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline bool isMarkupByte(unsigned char c) { return c <= 0x20 || c == '<' || c == '&'; }
+inline bool isCsvByte(unsigned char c) { return c == '"' || c == ',' || c == '\n'; }
+
+// First offset >= from holding '<', '&' or a byte <= 0x20 (whitespace and
+// controls), or size when there is none
+inline size_t findMarkupByte(const char* data, size_t size, size_t from) {
+    size_t i = from;
+#if defined(__AVX2__)
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i amp = _mm256_set1_epi8('&');
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, amp)));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        if (mask) return i + countTrailingZeros(mask);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i amp = _mm_set1_epi8('&');
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, space), v),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp)));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+        if (mask) return i + countTrailingZeros(mask);
+    }
+#endif
+    for (; i < size; i++) {
+        if (isMarkupByte(static_cast<unsigned char>(data[i]))) return i;
+    }
+    return size;
+}
+
+// First offset >= from holding '"', ',' or '\n', or size when there is none
+inline size_t findCsvByte(const char* data, size_t size, size_t from) {
+    size_t i = from;
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, newline)));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        if (mask) return i + countTrailingZeros(mask);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, newline)));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+        if (mask) return i + countTrailingZeros(mask);
+    }
+#endif
+    for (; i < size; i++) {
+        if (isCsvByte(static_cast<unsigned char>(data[i]))) return i;
+    }
+    return size;
+}
+
+} // namespace simdscan
+
+// Append a code point as UTF-8. Invalid code points become U+FFFD.
+template <typename String>
+inline void appendUtf8(uint32_t cp, String& out) {
+    if (cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) cp = 0xFFFD;
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// Decode the entity starting at text[pos] == '&'. Returns the number of bytes
+// consumed (0 when this is not a recognised entity) and the code point.
+inline size_t decodeEntity(string_view text, size_t pos, uint32_t& cp) {
+    static const struct { const char* name; uint32_t cp; } named[] = {
+        {"nbsp", 0x20}, {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''},
+        {"copy", 0xA9}, {"reg", 0xAE}, {"trade", 0x2122}, {"hellip", 0x2026},
+        {"ndash", 0x2013}, {"mdash", 0x2014}, {"lsquo", 0x2018}, {"rsquo", 0x2019},
+        {"ldquo", 0x201C}, {"rdquo", 0x201D}, {"euro", 0x20AC}, {"pound", 0xA3},
+        {"yen", 0xA5}, {"cent", 0xA2}, {"times", 0xD7}, {"deg", 0xB0}
+    };
+
+    size_t i = pos + 1;
+    if (i < text.size() && text[i] == '#') {
+        i++;
+        bool hex = i < text.size() && (text[i] == 'x' || text[i] == 'X');
+        if (hex) i++;
+        size_t digitsStart = i;
+        uint32_t value = 0;
+        for (; i < text.size() && i - digitsStart < 8; i++) {
+            char c = text[i];
+            uint32_t digit;
+            if (isDigit(c)) digit = static_cast<uint32_t>(c - '0');
+            else if (hex && lowerAscii(c) >= 'a' && lowerAscii(c) <= 'f') digit = static_cast<uint32_t>(lowerAscii(c) - 'a' + 10);
+            else break;
+            value = value * (hex ? 16 : 10) + digit;
+        }
+        if (i == digitsStart || i >= text.size() || text[i] != ';') return 0;
+        // &#160; is a non-breaking space; treat it like &nbsp;
+        cp = value == 0xA0 ? 0x20 : value;
+        return i + 1 - pos;
+    }
+
+    size_t nameStart = i;
+    while (i < text.size() && i - nameStart <= 6 && ((text[i] >= 'a' && text[i] <= 'z') || (text[i] >= 'A' && text[i] <= 'Z'))) i++;
+    if (i == nameStart || i >= text.size() || text[i] != ';') return 0;
+    string_view name = text.substr(nameStart, i - nameStart);
+    for (const auto& entity : named) {
+        if (name == entity.name) {
+            cp = entity.cp;
+            return i + 1 - pos;
+        }
+    }
+    return 0;
+}
+
+// True when cleanText could change the text: markup, entities, or whitespace
+// that is not a single inner space
+inline bool needsCleaning(string_view text) {
+    const char* data = text.data();
+    size_t pos = 0;
+    while ((pos = simdscan::findMarkupByte(data, text.size(), pos)) < text.size()) {
+        if (data[pos] != ' ' || pos == 0 || pos + 1 == text.size()) return true;
+        if (static_cast<unsigned char>(data[pos + 1]) <= 0x20) return true;
+        pos++;
+    }
+    return false;
+}
+
+// Strip tags, decode entities, collapse whitespace to single spaces and trim,
+// appending the result to out
+template <typename String>
+inline void appendCleanText(string_view text, String& out) {
+    if (!needsCleaning(text)) {
+        out.append(text.data(), text.size());
+        return;
+    }
+
+    const char* data = text.data();
+    const size_t start = out.size();
+    bool pendingSpace = false;
+    size_t pos = 0;
+
+    auto emit = [&](const char* bytes, size_t count) {
+        if (pendingSpace && out.size() > start) out += ' ';
+        pendingSpace = false;
+        out.append(bytes, count);
+    };
+
+    while (pos < text.size()) {
+        size_t hit = simdscan::findMarkupByte(data, text.size(), pos);
+        if (hit > pos) emit(data + pos, hit - pos);
+        if (hit == text.size()) break;
+
+        char c = data[hit];
+        pos = hit + 1;
+        if (c == '<') {
+            const void* close = memchr(data + hit, '>', text.size() - hit);
+            if (close) {
+                pos = static_cast<const char*>(close) - data + 1;
+            } else {
+                emit(data + hit, 1);
+            }
+        } else if (c == '&') {
+            uint32_t cp = 0;
+            size_t length = decodeEntity(text, hit, cp);
+            if (length == 0) {
+                emit(data + hit, 1);
+            } else if (cp == 0x20) {
+                pendingSpace = true;
+                pos = hit + length;
+            } else {
+                emit(data + hit, 0);
+                appendUtf8(cp, out);
+                pos = hit + length;
+            }
+        } else if (isHtmlSpace(c)) {
+            pendingSpace = true;
+        } else {
+            // Other control bytes are kept as-is
+            emit(data + hit, 1);
+        }
+    }
+}
+
+// Clean text without allocating when it is already clean: returns text itself
+// in that case, otherwise cleans into scratch and returns a view of it
+template <typename String>
+inline string_view cleanTextView(string_view text, String& scratch) {
+    if (!needsCleaning(text)) return text;
+    scratch.clear();
+    appendCleanText(text, scratch);
+    return scratch;
+}
+
+// Append a CSV field, quoting it (and doubling inner quotes) when it contains
+// a comma, quote or newline
+inline void appendCSVField(string_view text, string& out) {
+    const char* data = text.data();
+    size_t hit = simdscan::findCsvByte(data, text.size(), 0);
+    if (hit == text.size()) {
+        out.append(text);
+        return;
+    }
+
+    out += '"';
+    size_t pos = 0;
+    while (true) {
+        size_t quote = text.find('"', pos);
+        if (quote == string_view::npos) {
+            out.append(data + pos, text.size() - pos);
+            break;
+        }
+        out.append(data + pos, quote + 1 - pos);
+        out += '"';
+        pos = quote + 1;
+    }
+    out += '"';
+}
+
+// Evaluate a free-text rule (amount, labeled, out-of, ratio) over a
+// container's inner markup; empty for element rules
+string_view evaluateTextRule(const FieldRule& rule, string_view content) {
+    switch (rule.kind) {
+        case FieldRule::Amount:
+            return textscan::amount(content, rule.marker, true);
+        case FieldRule::LabeledAmount:
+            return textscan::amount(content, rule.marker, false);
+        case FieldRule::LabeledNumber:
+            return textscan::labeledNumber(content, rule.marker);
+        case FieldRule::OutOf:
+            return textscan::outOf(content);
+        case FieldRule::Ratio:
+            return textscan::ratio(content);
+        default:
+            return string_view();
+    }
+}
+
+// Evaluate one field rule inside a container. `first`/`last` delimit the
+// container's tokens, `content` is its inner markup. Returns the captured raw
+// text, or an empty view when the rule does not match.
+string_view evaluateFieldRule(const FieldRule& rule, string_view source, const TokenList& tokens,
+                              size_t first, size_t last, string_view content) {
+    switch (rule.kind) {
+        case FieldRule::Element:
+        case FieldRule::NumericElement: {
+            for (size_t i = first; i < last; i++) {
+                if (!rule.element.matches(source, tokens[i])) continue;
+
+                if (rule.kind == FieldRule::NumericElement) {
+                    if (i + 1 >= last) continue;
+                    const HtmlToken& close = tokens[i + 1];
+                    if (close.kind != HtmlToken::Close || !rule.element.matchesTag(close.name(source))) continue;
+                    string_view text = source.substr(tokens[i].end, close.begin - tokens[i].end);
+                    if (text.empty()) continue;
+                    bool numeric = true;
+                    for (char c : text) numeric = numeric && textscan::isNumberChar(c);
+                    if (numeric) return text;
+                    continue;
+                }
+
+                for (size_t j = i + 1; j < last; j++) {
+                    if (tokens[j].kind == HtmlToken::Close && rule.element.matchesTag(tokens[j].name(source))) {
+                        return source.substr(tokens[i].end, tokens[j].begin - tokens[i].end);
+                    }
+                }
+            }
+            return string_view();
+        }
+        default:
+            return evaluateTextRule(rule, content);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Extraction rules
+//
+// The container / name / price / rating tables are written in a small
+// line-based language and compiled once into both the token rules used by
+// extractProducts and the std::regex tables used by extractProductsRegex.
+// A compiled ExtractionRules object is immutable, so one instance can be
+// shared by every document and every thread.
+//
+//   # field      kind             arguments
+//   container    element          div class product item
+//   name         element          h1-h6 class title
+//   price        amount           $
+//   price        labeled-amount   Price:
+//   rating       numeric-element  span class rating
+//   rating       out-of
+//   price        css              .offer > span.amount
+//
+// Element arguments are: tags (comma separated, "h1-h6" for all headings),
+// attribute, then the substrings the attribute must contain in order, or a
+// single "=value" for an exact match. A css rule takes the rest of its line
+// as a CSS selector (see CssSelector) and captures the first matching
+// element's content ('#' starts a comment, so write ids as [id=...]).
+// Only the DOM engine evaluates css rules, so a rule set that uses them
+// always extracts with it.
+// ---------------------------------------------------------------------------
+
+const char* const kDefaultRules = R"rules(# Built-in extraction rules
+# Amazon-like patterns
+container  element          div  data-component-type  =s-search-result
+# Generic product containers
+container  element          div  class  product item
+container  element          div  class  product card
+container  element          article  class  product
+# List item patterns
+container  element          li  class  product
+# Generic item patterns
+container  element          div  class  item
+
+# Heading patterns
+name       element          h1-h6  class  title
+name       element          h1-h6  class  name
+name       element          h1-h6  class  product title
+# Link patterns
+name       element          a  class  title
+name       element          a  class  name
+name       element          a  class  product link
+# Span and div patterns
+name       element          span  class  title
+name       element          div  class  name
+name       element          span  class  name
+
+# Class-based patterns
+price      element          span  class  price
+price      element          div  class  price
+price      element          p  class  price
+# Currency patterns
+price      amount           $
+price      amount           ₹
+price      amount           €
+price      amount           £
+price      amount           USD
+price      amount           INR
+# Generic price patterns
+price      labeled-amount   Price:
+price      labeled-amount   Cost:
+
+rating     numeric-element  span  class  rating
+rating     numeric-element  div  class  star
+rating     numeric-element  span  class  star
+rating     out-of
+rating     ratio
+rating     labeled-number   Rating:
+rating     labeled-number   ★
+)rules";
+
+class ExtractionRules : public enable_shared_from_this<ExtractionRules> {
+public:
+    // Compiled regex tables for the reference engine, in rule order
+    struct RegexTables {
+        vector<regex> containers;
+        vector<regex> names;
+        vector<regex> prices;
+        vector<regex> ratings;
+        regex url;
+    };
+
+    // Built-in rules, compiled on first use and shared afterwards
+    static shared_ptr<const ExtractionRules> defaults() {
+        static const shared_ptr<const ExtractionRules> rules = compile(kDefaultRules, "built-in rules");
+        return rules;
+    }
+
+    static shared_ptr<const ExtractionRules> fromFile(const string& filename) {
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            throw runtime_error("Could not open rules file " + filename);
+        }
+        ostringstream text;
+        text << file.rdbuf();
+        return compile(text.str(), filename);
+    }
+
+    // Parse and compile a rules text. Throws runtime_error naming the
+    // offending line when the text is malformed.
+    static shared_ptr<const ExtractionRules> compile(const string& text, const string& origin) {
+        auto started = chrono::steady_clock::now();
+        shared_ptr<ExtractionRules> rules(new ExtractionRules());
+        rules->sourceText = text;
+        rules->originName = origin;
+
+        istringstream lines(text);
+        string line;
+        int lineNumber = 0;
+        vector<vector<RuleLabel>> labelsByField(4);
+        while (getline(lines, line)) {
+            lineNumber++;
+            size_t comment = line.find('#');
+            if (comment != string::npos) line.erase(comment);
+
+            istringstream words(line);
+            vector<string> args;
+            string word;
+            while (words >> word) args.push_back(word);
+            if (args.empty()) continue;
+
+            try {
+                rules->addRule(args);
+            } catch (const exception& e) {
+                throw runtime_error(origin + ":" + to_string(lineNumber) + ": " + e.what());
+            }
+
+            RuleLabel label{args[0], ""};
+            for (size_t i = 1; i < args.size(); i++) label.text += (i > 1 ? " " : "") + args[i];
+            labelsByField[fieldIndex(args[0])].push_back(move(label));
+        }
+
+        if (rules->tokenRules.containers.empty()) {
+            throw runtime_error(origin + ": no container rules defined");
+        }
+        rules->tokenRules.buildDispatch();
+        for (auto& labels : labelsByField) {
+            move(labels.begin(), labels.end(), back_inserter(rules->labels));
+        }
+        rules->ruleCounters.reset(new RuleCounters[rules->ruleCount()]);
+        rules->regexTables.url = regex("<a[^>]*href=\"([^\"]*)\"", regex_constants::icase);
+
+        rules->compileDuration = chrono::steady_clock::now() - started;
+        return rules;
+    }
+
+    const TokenRuleSet& tokens() const { return tokenRules; }
+    bool usesSelectors() const { return selectorRules; }
+    const RegexTables& regexes() const { return regexTables; }
+    const string& source() const { return sourceText; }
+    const string& origin() const { return originName; }
+
+    size_t ruleCount() const {
+        return tokenRules.containers.size() + tokenRules.names.size() +
+               tokenRules.prices.size() + tokenRules.ratings.size();
+    }
+
+    double compileMillis() const {
+        return chrono::duration<double, milli>(compileDuration).count();
+    }
+
+    // A rule as written: field ("price") and the rest of its line
+    struct RuleLabel {
+        string field;
+        string text;
+    };
+
+    // Labels and counters of every rule, containers first, then names,
+    // prices and ratings. The counters are the one mutable part of a
+    // compiled rule set; they are atomic, so sharing stays safe.
+    const vector<RuleLabel>& ruleLabels() const { return labels; }
+    RuleCounters* counters() const { return ruleCounters.get(); }
+
+private:
+    TokenRuleSet tokenRules;
+    RegexTables regexTables;
+    bool selectorRules = false;
+    string sourceText;
+    string originName;
+    chrono::steady_clock::duration compileDuration{};
+    vector<RuleLabel> labels;
+    unique_ptr<RuleCounters[]> ruleCounters;
+
+    ExtractionRules() = default;
+
+    static size_t fieldIndex(const string& field) {
+        return field == "container" ? 0 : field == "name" ? 1 : field == "price" ? 2 : 3;
+    }
+
+    static string lowerCase(string text) {
+        for (char& c : text) c = lowerAscii(c);
+        return text;
+    }
+
+    static string escapeRegex(const string& text) {
+        static const string special = "\\^$.|?*+()[]{}";
+        string escaped;
+        for (char c : text) {
+            if (special.find(c) != string::npos) escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    static TagRule parseTagRule(const vector<string>& args, size_t first) {
+        if (args.size() < first + 3) {
+            throw runtime_error("element rules need: tags attribute needle...");
+        }
+        TagRule rule;
+        if (args[first] == "h1-h6") {
+            rule.tags = {"h1", "h2", "h3", "h4", "h5", "h6"};
+        } else {
+            istringstream tags(args[first]);
+            string tag;
+            while (getline(tags, tag, ',')) {
+                if (!tag.empty()) rule.tags.push_back(lowerCase(tag));
+            }
+        }
+        rule.attribute = lowerCase(args[first + 1]);
+        for (size_t i = first + 2; i < args.size(); i++) {
+            rule.needles.push_back(lowerCase(args[i]));
+        }
+        if (rule.needles[0][0] == '=') {
+            if (rule.needles.size() != 1 || rule.needles[0].size() < 2) {
+                throw runtime_error("exact match takes a single =value");
+            }
+            rule.exact = true;
+            rule.needles[0].erase(0, 1);
+        }
+        if (rule.tags.empty()) throw runtime_error("missing tag name");
+        rule.selector = CssSelector::element(rule.tags, rule.attribute, rule.needles, rule.exact);
+        return rule;
+    }
+
+    // A css rule: the rest of the line is the selector
+    static TagRule parseSelectorRule(const vector<string>& args, size_t first) {
+        if (args.size() <= first) throw runtime_error("css rules need a selector");
+        string text;
+        for (size_t i = first; i < args.size(); i++) text += (i > first ? " " : "") + args[i];
+        TagRule rule;
+        rule.css = true;
+        rule.selector = CssSelector::parse(text);
+        return rule;
+    }
+
+    // <tag[^>]*attr="[^"]*a[^"]*b[^"]*"[^>]*>CAPTURE</tag>
+    static string tagRegex(const TagRule& rule, const string& capture) {
+        string tag;
+        if (rule.tags.size() == 6 && rule.tags[0] == "h1" && rule.tags[5] == "h6") {
+            tag = "h[1-6]";
+        } else if (rule.tags.size() == 1) {
+            tag = escapeRegex(rule.tags[0]);
+        } else {
+            for (const auto& name : rule.tags) tag += (tag.empty() ? "(?:" : "|") + escapeRegex(name);
+            tag += ")";
+        }
+
+        string value;
+        if (rule.exact) {
+            value = escapeRegex(rule.needles[0]);
+        } else {
+            value = "[^\"]*";
+            for (const auto& needle : rule.needles) value += escapeRegex(needle) + "[^\"]*";
+        }
+        return "<" + tag + "[^>]*" + escapeRegex(rule.attribute) + "=\"" + value + "\"[^>]*>" +
+               capture + "</" + tag + ">";
+    }
+
+    void addRule(const vector<string>& args) {
+        if (args.size() < 2) throw runtime_error("expected: field kind arguments...");
+        const string& field = args[0];
+        const string& kind = args[1];
+
+        if (field == "container") {
+            if (kind == "css") {
+                tokenRules.containers.push_back(parseSelectorRule(args, 2));
+                selectorRules = true;
+                return;
+            }
+            if (kind != "element") throw runtime_error("containers only support element and css rules");
+            TagRule rule = parseTagRule(args, 2);
+            regexTables.containers.emplace_back(tagRegex(rule, "(.*?)"), regex_constants::icase);
+            tokenRules.containers.push_back(move(rule));
+            return;
+        }
+
+        vector<FieldRule>* table = nullptr;
+        vector<regex>* regexTable = nullptr;
+        if (field == "name") {
+            table = &tokenRules.names;
+            regexTable = &regexTables.names;
+        } else if (field == "price") {
+            table = &tokenRules.prices;
+            regexTable = &regexTables.prices;
+        } else if (field == "rating") {
+            table = &tokenRules.ratings;
+            regexTable = &regexTables.ratings;
+        } else {
+            throw runtime_error("unknown field '" + field + "'");
+        }
+
+        FieldRule rule;
+        string pattern;
+        auto requireMarker = [&]() -> const string& {
+            if (args.size() != 3) throw runtime_error(kind + " rules take exactly one marker");
+            return args[2];
+        };
+
+        if (kind == "element" || kind == "numeric-element") {
+            rule.kind = kind == "element" ? FieldRule::Element : FieldRule::NumericElement;
+            rule.element = parseTagRule(args, 2);
+            pattern = tagRegex(rule.element, rule.kind == FieldRule::Element ? "(.*?)" : "([0-9.]+)");
+        } else if (kind == "amount") {
+            rule.kind = FieldRule::Amount;
+            rule.marker = lowerCase(requireMarker());
+            pattern = escapeRegex(rule.marker) + "\\s*[\\d,]+\\.?\\d*";
+        } else if (kind == "labeled-amount") {
+            rule.kind = FieldRule::LabeledAmount;
+            rule.marker = lowerCase(requireMarker());
+            pattern = escapeRegex(rule.marker) + "\\s*([\\d,]+\\.?\\d*)";
+        } else if (kind == "labeled-number") {
+            rule.kind = FieldRule::LabeledNumber;
+            rule.marker = lowerCase(requireMarker());
+            pattern = escapeRegex(rule.marker) + "\\s*([0-9.]+)";
+        } else if (kind == "out-of") {
+            rule.kind = FieldRule::OutOf;
+            pattern = "([0-9.]+)\\s*out\\s*of\\s*[0-9]+";
+        } else if (kind == "ratio") {
+            rule.kind = FieldRule::Ratio;
+            pattern = "([0-9.]+)\\s*/\\s*[0-9]+";
+        } else if (kind == "css") {
+            // No regex form; the reference engine leaves css rules out
+            rule.kind = FieldRule::Selector;
+            rule.element = parseSelectorRule(args, 2);
+            table->push_back(move(rule));
+            selectorRules = true;
+            return;
+        } else {
+            throw runtime_error("unknown rule kind '" + kind + "'");
+        }
+
+        regexTable->emplace_back(pattern, regex_constants::icase);
+        table->push_back(move(rule));
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Logging
+//
+// Progress and status messages from the scraper go through a Logger rather
+// than straight to the console, so a program that embeds the scraper
+// decides where they go. Messages below the logger's level are dropped
+// before they are formatted. The default handler writes info to stdout and
+// warnings and errors to stderr, one whole line at a time even when
+// several threads log at once.
+// ---------------------------------------------------------------------------
+
+class Logger {
+public:
+    enum Level { Info, Warning, Error, Silent };
+    using Handler = function<void(Level, const string&)>;
+
+    // One message, sent to the logger when the statement ends:
+    //   logger.info() << "Loaded " << count << " products";
+    class Line {
+    public:
+        Line(const Logger* target, Level level) : target(target), level(level) {}
+        Line(Line&& other) noexcept : target(other.target), level(other.level), text(move(other.text)) {
+            other.target = nullptr;
+        }
+        ~Line() {
+            if (target) target->write(level, text.str());
+        }
+
+        template <typename T>
+        Line& operator<<(const T& value) {
+            if (target) text << value;
+            return *this;
+        }
+
+    private:
+        const Logger* target;
+        Level level;
+        ostringstream text;
+    };
+
+    explicit Logger(Level minimum = Info, Handler handler = console(false))
+        : minimum(minimum), handler(move(handler)) {}
+
+    bool enabled(Level level) const { return level >= minimum && handler; }
+
+    Line info() const { return line(Info); }
+    Line warning() const { return line(Warning); }
+    Line error() const { return line(Error); }
+
+    void write(Level level, const string& message) const {
+        if (enabled(level)) handler(level, message);
+    }
+
+    // stdout for info (stderr when stdout carries data); stderr with a
+    // "Warning: " / "Error: " prefix otherwise
+    static Handler console(bool infoToStderr = false) {
+        return [infoToStderr](Level level, const string& message) {
+            static mutex consoleLock;
+            lock_guard<mutex> guard(consoleLock);
+            if (level == Info) {
+                (infoToStderr ? cerr : cout) << message << endl;
+            } else {
+                cerr << (level == Warning ? "Warning: " : "Error: ") << message << endl;
+            }
+        };
+    }
+
+    static shared_ptr<const Logger> silent() {
+        static const shared_ptr<const Logger> logger = make_shared<Logger>(Silent, nullptr);
+        return logger;
+    }
+
+private:
+    Level minimum;
+    Handler handler;
+
+    Line line(Level level) const { return Line(enabled(level) ? this : nullptr, level); }
+};
+
+// ---------------------------------------------------------------------------
+// Metrics
+//
+// Off unless enabled at runtime (SCRAPER_METRICS=<file> or --metrics FILE,
+// "-" for stderr). While on, StageTimer records wall time, CPU time and
+// heap allocations for the load, container match, field extraction, clean
+// and serialize stages, and extraction counts attempts, hits and time for
+// every rule (allocations only with -DSCRAPER_COUNT_ALLOCATIONS, see
+// allocstats). Each rule set used also reports how long it took to compile.
+// Stage figures are exclusive: a nested stage pauses the one around it.
+// The report is written as JSON when the program exits. When off, each
+// instrumented point costs one relaxed load.
+// ---------------------------------------------------------------------------
+
+inline void appendJSONString(string_view text, string& out);
+
+// CPU time of the calling thread in nanoseconds
+inline uint64_t threadCpuNanoseconds() {
+#ifdef SCRAPER_HAVE_MMAP
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+#else
+    return static_cast<uint64_t>(clock()) * (1000000000ull / CLOCKS_PER_SEC);
+#endif
+}
+
+class Metrics {
+public:
+    enum Stage { Load, ContainerMatch, FieldExtraction, Clean, Serialize, StageCount };
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static bool enabled() { return on.load(memory_order_relaxed); }
+
+    // Start collecting; the report goes to `destination` at exit
+    void enable(const string& destination) {
+        lock_guard<mutex> guard(lock);
+        outputPath = destination.empty() ? "-" : destination;
+        if (!on.exchange(true)) {
+            started = chrono::steady_clock::now();
+            allocationsAtStart = allocstats::count.load();
+            allocstats::enabled = true;
+            atexit([] { Metrics::instance().dump(); });
+        }
+    }
+
+    void recordStage(Stage stage, uint64_t wallNs, uint64_t cpuNs, uint64_t allocations) {
+        stages[stage].calls.fetch_add(1, memory_order_relaxed);
+        stages[stage].wallNs.fetch_add(wallNs, memory_order_relaxed);
+        stages[stage].cpuNs.fetch_add(cpuNs, memory_order_relaxed);
+        stages[stage].allocations.fetch_add(allocations, memory_order_relaxed);
+    }
+
+    void countDocument(size_t size, size_t found) {
+        documents.fetch_add(1, memory_order_relaxed);
+        bytes.fetch_add(size, memory_order_relaxed);
+        products.fetch_add(found, memory_order_relaxed);
+    }
+
+    // Counters for `rules`, or null when metrics are off. The rule set is
+    // kept alive so the report can name its rules.
+    RuleCounters* countersFor(const ExtractionRules& rules) {
+        if (!enabled()) return nullptr;
+        lock_guard<mutex> guard(lock);
+        if (none_of(tracked.begin(), tracked.end(), [&](const shared_ptr<const ExtractionRules>& known) {
+                return known.get() == &rules;
+            })) {
+            tracked.push_back(rules.shared_from_this());
+        }
+        return rules.counters();
+    }
+
+    string report() const {
+        static const char* const stageNames[StageCount] = {
+            "load", "container_match", "field_extraction", "clean", "serialize"
+        };
+        auto number = [](double value) {
+            ostringstream text;
+            text << fixed << setprecision(3) << value;
+            return text.str();
+        };
+
+        // Allocation figures are null unless counting was compiled in
+        auto counted = [](const string& value) { return allocstats::available ? value : string("null"); };
+
+        lock_guard<mutex> guard(lock);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        // Heap traffic of the extraction itself, apart from rule
+        // compilation, file handling and output
+        uint64_t found = products.load();
+        uint64_t extractionAllocations = stages[ContainerMatch].allocations.load() +
+                                         stages[FieldExtraction].allocations.load() +
+                                         stages[Clean].allocations.load();
+        string out = "{\n  \"wall_seconds\": " + number(seconds) +
+                     ",\n  \"documents\": " + to_string(documents.load()) +
+                     ",\n  \"bytes\": " + to_string(bytes.load()) +
+                     ",\n  \"products\": " + to_string(found) +
+                     ",\n  \"heap_allocations\": " +
+                     counted(to_string(allocstats::count.load() - allocationsAtStart)) +
+                     ",\n  \"extraction_allocations_per_product\": " +
+                     counted(number(found ? static_cast<double>(extractionAllocations) / found : 0.0)) +
+                     ",\n  \"stages\": {";
+        for (int stage = 0; stage < StageCount; stage++) {
+            out += string(stage ? "," : "") + "\n    \"" + stageNames[stage] + "\": {\"calls\": " +
+                   to_string(stages[stage].calls.load()) +
+                   ", \"wall_ms\": " + number(stages[stage].wallNs.load() / 1e6) +
+                   ", \"cpu_ms\": " + number(stages[stage].cpuNs.load() / 1e6) +
+                   ", \"allocations\": " + counted(to_string(stages[stage].allocations.load())) + "}";
+        }
+        out += "\n  },\n  \"rule_sets\": [";
+        for (size_t set = 0; set < tracked.size(); set++) {
+            const ExtractionRules& rules = *tracked[set];
+            out += string(set ? "," : "") + "\n    {\"origin\": \"";
+            appendJSONString(rules.origin(), out);
+            out += "\", \"compile_ms\": " + number(rules.compileMillis()) + ", \"rules\": [";
+            for (size_t i = 0; i < rules.ruleLabels().size(); i++) {
+                const RuleCounters& counter = rules.counters()[i];
+                uint64_t attempts = counter.attempts.load();
+                uint64_t nanoseconds = counter.nanoseconds.load();
+                out += string(i ? "," : "") + "\n      {\"field\": \"" + rules.ruleLabels()[i].field + "\", \"rule\": \"";
+                appendJSONString(rules.ruleLabels()[i].text, out);
+                out += "\", \"attempts\": " + to_string(attempts) +
+                       ", \"hits\": " + to_string(counter.hits.load()) +
+                       ", \"total_ms\": " + number(nanoseconds / 1e6) +
+                       ", \"ns_per_attempt\": " + number(attempts ? static_cast<double>(nanoseconds) / attempts : 0.0) + "}";
+            }
+            out += "\n    ]}";
+        }
+        out += "\n  ]\n}\n";
+        return out;
+    }
+
+    void dump() {
+        string json = report();
+        string destination;
+        {
+            lock_guard<mutex> guard(lock);
+            destination = outputPath;
+        }
+        if (destination == "-") {
+            cerr << json;
+            return;
+        }
+        ofstream file(destination, ios::binary);
+        if (!(file << json)) cerr << "Error: Could not write metrics to " << destination << endl;
+    }
+
+private:
+    struct StageTotals {
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> wallNs{0};
+        atomic<uint64_t> cpuNs{0};
+        atomic<uint64_t> allocations{0};
+    };
+
+    inline static atomic<bool> on{false};
+
+    StageTotals stages[StageCount];
+    atomic<uint64_t> documents{0};
+    atomic<uint64_t> bytes{0};
+    atomic<uint64_t> products{0};
+    mutable mutex lock;
+    vector<shared_ptr<const ExtractionRules>> tracked;
+    string outputPath;
+    chrono::steady_clock::time_point started;
+    uint64_t allocationsAtStart = 0;
+
+    Metrics() = default;
+};
+
+// Times the enclosing scope as one stage when metrics are enabled
+class StageTimer {
+public:
+    explicit StageTimer(Metrics::Stage timedStage) {
+        if (!Metrics::enabled()) return;
+        stage = timedStage;
+        active = true;
+        parent = current;
+        current = this;
+        Sample now = Sample::take();
+        if (parent) parent->pause(now);
+        resumed = now;
+    }
+
+    ~StageTimer() {
+        if (!active) return;
+        Sample now = Sample::take();
+        pause(now);
+        Metrics::instance().recordStage(stage, wallNs, cpuNs, allocations);
+        current = parent;
+        if (parent) parent->resumed = now;
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    struct Sample {
+        uint64_t wall;
+        uint64_t cpu;
+        uint64_t allocations;
+
+        static Sample take() {
+            auto wall = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch());
+            return Sample{static_cast<uint64_t>(wall.count()), threadCpuNanoseconds(), allocstats::threadCount};
+        }
+    };
+
+    inline static thread_local StageTimer* current = nullptr;
+
+    Metrics::Stage stage = Metrics::Load;
+    bool active = false;
+    StageTimer* parent = nullptr;
+    Sample resumed{0, 0, 0};
+    uint64_t wallNs = 0;
+    uint64_t cpuNs = 0;
+    uint64_t allocations = 0;
+
+    void pause(const Sample& now) {
+        wallNs += now.wall - resumed.wall;
+        cpuNs += now.cpu - resumed.cpu;
+        allocations += now.allocations - resumed.allocations;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Input documents
+// ---------------------------------------------------------------------------
+
+// Read-only contents of an input file. The file is memory-mapped where the
+// platform supports it; otherwise it is read in one go into a buffer of the
+// exact file size. Bytes are exposed unchanged (no newline translation).
+class HtmlSource {
+public:
+    HtmlSource(const HtmlSource&) = delete;
+    HtmlSource& operator=(const HtmlSource&) = delete;
+
+    ~HtmlSource() {
+#ifdef SCRAPER_HAVE_MMAP
+        if (mapped) munmap(const_cast<char*>(data), length);
+#endif
+    }
+
+    // Regular files are mapped where possible, otherwise read; pipes (such
+    // as /dev/stdin) are read until EOF. Throws runtime_error for anything
+    // else, or when the file cannot be opened or read.
+    static shared_ptr<const HtmlSource> open(const string& filename) {
+        StageTimer timer(Metrics::Load);
+        error_code error;
+        filesystem::file_status status = filesystem::status(filename, error);
+        if (error) throw runtime_error("Could not open file " + filename);
+        bool regular = filesystem::is_regular_file(status);
+        if (!regular && !filesystem::is_fifo(status)) {
+            throw runtime_error(filename + " is not a regular file or a pipe");
+        }
+
+        shared_ptr<HtmlSource> source(new HtmlSource());
+#ifdef SCRAPER_HAVE_MMAP
+        if (regular && source->map(filename)) return source;
+#endif
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            throw runtime_error("Could not open file " + filename);
+        }
+        // The size is only a hint: a pipe has none and a file may change
+        string& buffer = source->buffer;
+        if (regular) {
+            uintmax_t size = filesystem::file_size(filename, error);
+            if (!error) buffer.reserve(static_cast<size_t>(size));
+        }
+        size_t used = 0;
+        while (file) {
+            buffer.resize(max(used + (64u << 10), buffer.capacity()));
+            file.read(&buffer[used], static_cast<streamsize>(buffer.size() - used));
+            used += static_cast<size_t>(file.gcount());
+        }
+        if (file.bad()) throw runtime_error("Could not read file " + filename);
+        buffer.resize(used);
+        source->data = source->buffer.data();
+        source->length = source->buffer.size();
+        return source;
+    }
+
+    // Wrap HTML that is already in memory
+    static shared_ptr<const HtmlSource> fromString(string html) {
+        shared_ptr<HtmlSource> source(new HtmlSource());
+        source->buffer = move(html);
+        source->data = source->buffer.data();
+        source->length = source->buffer.size();
+        return source;
+    }
+
+    string_view view() const { return string_view(data, length); }
+    size_t size() const { return length; }
+    bool isMapped() const { return mapped; }
+
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    string buffer;
+
+    HtmlSource() = default;
+
+#ifdef SCRAPER_HAVE_MMAP
+    bool map(const string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        bool ok = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0;
+        if (ok) {
+            void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = address != MAP_FAILED;
+            if (ok) {
+                madvise(address, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+                data = static_cast<const char*>(address);
+                length = static_cast<size_t>(info.st_size);
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+#endif
+};
+
+// Scratch memory for extracting one document. The token list, scheduler
+// stack, duplicate filter and cleaning buffer all come from a monotonic
+// arena that starts in a buffer inside this object and is released in one
+// step when the document is done.
+class DocumentArena {
+public:
+    DocumentArena() : arena(inlineBuffer, sizeof(inlineBuffer), pmr::new_delete_resource()) {}
+
+    DocumentArena(const DocumentArena&) = delete;
+    DocumentArena& operator=(const DocumentArena&) = delete;
+
+    pmr::memory_resource* resource() { return &arena; }
+
+private:
+    alignas(max_align_t) char inlineBuffer[16u << 10];
+    pmr::monotonic_buffer_resource arena;
+};
+
+// Append-only text storage. Strings are packed into large blocks, so
+// storing one costs no allocation of its own; views stay valid until
+// clear(), which keeps the first block for reuse.
+class TextArena {
+public:
+    string_view store(string_view text) {
+        if (text.empty()) return string_view();
+        if (blocks.empty() || text.size() > capacity - used) {
+            size_t size = max(kBlockSize, text.size());
+            blocks.emplace_back(new char[size]);
+            capacity = size;
+            used = 0;
+        }
+        char* at = blocks.back().get() + used;
+        memcpy(at, text.data(), text.size());
+        used += text.size();
+        return string_view(at, text.size());
+    }
+
+    void clear() {
+        if (blocks.size() > 1 || capacity != kBlockSize) {
+            blocks.clear();
+            capacity = 0;
+        }
+        used = 0;
+    }
+
+private:
+    static constexpr size_t kBlockSize = 64u << 10;
+
+    vector<unique_ptr<char[]>> blocks;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+// Products extracted from one document. Holds a reference to the source so
+// views into it stay valid until the batch has been written out, plus the
+// few strings that cleaning had to rewrite.
+class ProductBatch {
+public:
+    shared_ptr<const HtmlSource> source;
+    vector<ProductView> products;
+    // Where the document came from, if known; relative links resolve against it
+    string baseUrl;
+
+    // Copy text into storage owned by the batch and return a stable view of it
+    string_view store(string_view text) {
+        return arena.store(text);
+    }
+
+    // Like store(), but short strings that repeat (ratings such as "4.5")
+    // are kept once
+    string_view intern(string_view text) {
+        if (text.size() > kInternLimit) return store(text);
+        auto found = interned.find(text);
+        if (found != interned.end()) return *found;
+        string_view stored = store(text);
+        interned.insert(stored);
+        return stored;
+    }
+
+    // Add a product that owns its strings (e.g. generated sample data)
+    void add(const Product& product) {
+        ProductView view(product);
+        view.name = store(product.name);
+        view.price = store(product.price);
+        view.rating = intern(product.rating);
+        view.url = store(product.url);
+        products.push_back(view);
+    }
+
+    // Copy a product from elsewhere (e.g. a cached file), keeping its
+    // parsed price and rating
+    void add(const ProductView& product) {
+        ProductView view = product;
+        view.name = store(product.name);
+        view.price = store(product.price);
+        view.rating = intern(product.rating);
+        view.url = store(product.url);
+        products.push_back(view);
+    }
+
+    void clear() {
+        source.reset();
+        products.clear();
+        baseUrl.clear();
+        interned.clear();
+        arena.clear();
+    }
+
+    // Copy every field into the batch and drop the source, so a mapping
+    // does not have to stay open while the batch waits to be written
+    void detachFromSource() {
+        if (!source) return;
+        string_view document = source->view();
+        auto inSource = [&](string_view text) {
+            return !text.empty() && text.data() >= document.data() &&
+                   text.data() < document.data() + document.size();
+        };
+        for (auto& product : products) {
+            if (inSource(product.name)) product.name = store(product.name);
+            if (inSource(product.price)) product.price = store(product.price);
+            if (inSource(product.rating)) product.rating = intern(product.rating);
+            if (inSource(product.url)) product.url = store(product.url);
+        }
+        source.reset();
+    }
+
+    size_t size() const { return products.size(); }
+    bool empty() const { return products.empty(); }
+
+private:
+    static constexpr size_t kInternLimit = 8;
+
+    TextArena arena;
+    unordered_set<string_view> interned;
+};
+
+// ---------------------------------------------------------------------------
+// URL normalization
+//
+// Product links are stored as written in the page ("/iphone-14-pro",
+// "HTTPS://Shop.example/p?id=1&utm_source=x#reviews"), so one product can
+// reach the output in several forms. When enabled, every link is resolved
+// against the document's base URL (RFC 3986, section 5.2) and normalized:
+// scheme and host lower-cased, default port dropped, "." and ".." segments
+// removed, percent-escapes upper-cased, tracking parameters and the
+// fragment stripped, and "&amp;" in the query decoded. Equal products then
+// carry equal URLs and are caught by the extractor's duplicate check.
+// Links that are not http(s), and bare "#..." anchors, are left as they are.
+// ---------------------------------------------------------------------------
+
+class UrlNormalizer {
+public:
+    // Parts of a URL reference, as views into it
+    struct Parts {
+        string_view scheme;
+        string_view authority;
+        string_view path;
+        string_view query;
+        bool hasScheme = false;
+        bool hasAuthority = false;
+        bool hasQuery = false;
+    };
+
+    // Query parameters dropped by default; a trailing '*' matches a prefix
+    static const vector<string>& defaultTrackingParams() {
+        static const vector<string> params = {
+            "utm_*", "gclid", "dclid", "gbraid", "wbraid", "fbclid", "msclkid", "yclid", "mc_cid", "mc_eid",
+            "_ga", "_gl", "igshid", "srsltid", "ref", "ref_", "pd_rd_*", "pf_rd_*"
+        };
+        return params;
+    }
+
+    explicit UrlNormalizer(vector<string> trackingParams = defaultTrackingParams())
+        : tracking(move(trackingParams)) {}
+
+    const vector<string>& trackingParams() const { return tracking; }
+
+    // Stable text naming this configuration (part of cache keys)
+    string description() const {
+        string text = "normalize";
+        for (const auto& param : tracking) text += " " + param;
+        return text;
+    }
+
+    static Parts split(string_view url) {
+        Parts parts;
+        size_t fragment = url.find('#');
+        if (fragment != string_view::npos) url = url.substr(0, fragment);
+
+        size_t colon = url.find(':');
+        if (colon != string_view::npos && colon > 0 && isSchemeStart(url[0]) &&
+            all_of(url.begin() + 1, url.begin() + colon, isSchemeChar)) {
+            parts.scheme = url.substr(0, colon);
+            parts.hasScheme = true;
+            url.remove_prefix(colon + 1);
+        }
+        if (url.size() >= 2 && url[0] == '/' && url[1] == '/') {
+            size_t end = url.find_first_of("/?", 2);
+            if (end == string_view::npos) end = url.size();
+            parts.authority = url.substr(2, end - 2);
+            parts.hasAuthority = true;
+            url.remove_prefix(end);
+        }
+        size_t question = url.find('?');
+        if (question != string_view::npos) {
+            parts.query = url.substr(question + 1);
+            parts.hasQuery = true;
+            url = url.substr(0, question);
+        }
+        parts.path = url;
+        return parts;
+    }
+
+    // Resolve href against base (an absolute http(s) URL, or empty for
+    // none) and write the normalized result to out
+    template <typename String>
+    void normalize(string_view href, string_view base, String& out) const {
+        out.clear();
+        href = trim(href);
+        if (href.empty() || href[0] == '#') {
+            out.append(href.data(), href.size());
+            return;
+        }
+
+        Parts ref = split(href);
+        if (ref.hasScheme && !isHttp(ref.scheme)) {
+            out.append(href.data(), href.size());
+            return;
+        }
+        Parts root = split(trim(base));
+        bool hasBase = root.hasScheme && root.hasAuthority && isHttp(root.scheme);
+
+        // RFC 3986 5.2.2, without the strict-parser scheme case
+        Parts target = ref;
+        bool mergePath = false;
+        if (!ref.hasScheme && hasBase) {
+            target.scheme = root.scheme;
+            target.hasScheme = true;
+            if (!ref.hasAuthority) {
+                target.authority = root.authority;
+                target.hasAuthority = true;
+                if (ref.path.empty()) {
+                    target.path = root.path;
+                    if (!ref.hasQuery) {
+                        target.query = root.query;
+                        target.hasQuery = root.hasQuery;
+                    }
+                } else if (ref.path[0] != '/') {
+                    mergePath = true;
+                }
+            }
+        }
+
+        if (target.hasScheme) {
+            appendLower(target.scheme, out);
+            out += ':';
+        }
+        if (target.hasAuthority) {
+            out += "//";
+            appendAuthority(target.authority, target.scheme, out);
+        }
+        size_t pathStart = out.size();
+        if (mergePath) {
+            // Base directory, then the reference
+            size_t slash = root.path.rfind('/');
+            if (slash == string_view::npos) out += '/';
+            else out.append(root.path.data(), slash + 1);
+        }
+        out.append(target.path.data(), target.path.size());
+        if (out.size() > pathStart && out[pathStart] == '/') removeDotSegments(out, pathStart);
+        if (target.hasAuthority && out.size() == pathStart) out += '/';
+        if (target.hasQuery) appendQuery(target.query, out);
+        upperCaseEscapes(out, pathStart);
+    }
+
+    string normalize(string_view href, string_view base = string_view()) const {
+        string out;
+        normalize(href, base, out);
+        return out;
+    }
+
+    bool isTrackingParam(string_view name) const {
+        for (const auto& param : tracking) {
+            if (!param.empty() && param.back() == '*') {
+                size_t prefix = param.size() - 1;
+                if (name.size() >= prefix && equalsIgnoreCase(name.substr(0, prefix), string_view(param).substr(0, prefix))) {
+                    return true;
+                }
+            } else if (equalsIgnoreCase(name, param)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    vector<string> tracking;
+
+    static bool isSchemeStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    static bool isSchemeChar(char c) {
+        return isSchemeStart(c) || (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.';
+    }
+    static bool isHttp(string_view scheme) {
+        return equalsIgnoreCase(scheme, "http") || equalsIgnoreCase(scheme, "https");
+    }
+
+    static string_view trim(string_view text) {
+        size_t begin = text.find_first_not_of(" \t\r\n\f");
+        if (begin == string_view::npos) return string_view();
+        size_t end = text.find_last_not_of(" \t\r\n\f");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    template <typename String>
+    static void appendLower(string_view text, String& out) {
+        for (char c : text) out += (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    // userinfo@host:port with the host lower-cased and a default port dropped
+    template <typename String>
+    static void appendAuthority(string_view authority, string_view scheme, String& out) {
+        size_t at = authority.rfind('@');
+        if (at != string_view::npos) {
+            out.append(authority.data(), at + 1);
+            authority.remove_prefix(at + 1);
+        }
+        size_t hostEnd = authority.empty() || authority[0] != '[' ? authority.rfind(':') : authority.find("]:");
+        if (hostEnd != string_view::npos && authority[hostEnd] == ']') hostEnd++;
+        string_view host = authority.substr(0, hostEnd);
+        string_view port = hostEnd == string_view::npos ? string_view() : authority.substr(hostEnd + 1);
+        appendLower(host, out);
+        bool defaultPort = (port == "80" && equalsIgnoreCase(scheme, "http")) ||
+                           (port == "443" && equalsIgnoreCase(scheme, "https"));
+        if (!port.empty() && !defaultPort) {
+            out += ':';
+            out.append(port.data(), port.size());
+        }
+    }
+
+    // Rewrite the absolute path out[start..] without "." and ".." segments
+    template <typename String>
+    static void removeDotSegments(String& out, size_t start) {
+        size_t end = out.size();
+        size_t read = start + 1;
+        size_t write = start + 1;
+        while (true) {
+            size_t slash = read;
+            while (slash < end && out[slash] != '/') slash++;
+            size_t length = slash - read;
+            bool last = slash == end;
+            if (length == 1 && out[read] == '.') {
+                // nothing to keep
+            } else if (length == 2 && out[read] == '.' && out[read + 1] == '.') {
+                if (write > start + 1) {
+                    write--;
+                    while (write > start + 1 && out[write - 1] != '/') write--;
+                }
+            } else {
+                memmove(&out[write], &out[read], length);
+                write += length;
+                if (!last) out[write++] = '/';
+            }
+            if (last) break;
+            read = slash + 1;
+        }
+        out.resize(write);
+    }
+
+    // "?" and the parameters that are not tracking ones; nothing if none are left
+    template <typename String>
+    void appendQuery(string_view query, String& out) const {
+        size_t mark = out.size();
+        bool any = false;
+        size_t i = 0;
+        while (i <= query.size()) {
+            size_t end = i;
+            while (end < query.size() && query[end] != '&') end++;
+            string_view param = query.substr(i, end - i);
+            i = end + 1;
+            if (end < query.size() && query.compare(end + 1, 4, "amp;") == 0) i += 4;
+            if (param.empty()) continue;
+            if (isTrackingParam(param.substr(0, param.find('=')))) continue;
+            out += any ? '&' : '?';
+            out.append(param.data(), param.size());
+            any = true;
+        }
+        if (!any) out.resize(mark);
+    }
+
+    template <typename String>
+    static void upperCaseEscapes(String& out, size_t start) {
+        for (size_t i = start; i + 2 < out.size(); i++) {
+            if (out[i] != '%' || !isxdigit(static_cast<unsigned char>(out[i + 1])) ||
+                !isxdigit(static_cast<unsigned char>(out[i + 2]))) {
+                continue;
+            }
+            out[i + 1] = static_cast<char>(toupper(static_cast<unsigned char>(out[i + 1])));
+            out[i + 2] = static_cast<char>(toupper(static_cast<unsigned char>(out[i + 2])));
+            i += 2;
+        }
+    }
+};
+
+// How the links of one document are normalized; a null normalizer turns
+// normalization off
+struct UrlContext {
+    const UrlNormalizer* normalizer = nullptr;
+    string_view base;
+};
+
+// True for <base href="...">, whose href then replaces the document URL
+inline bool findBaseHref(string_view source, const HtmlToken& token, string_view& href) {
+    return token.kind == HtmlToken::Open && equalsIgnoreCase(token.name(source), "base") &&
+           findAttribute(token.attributes(source), "href", href);
+}
+
+// ---------------------------------------------------------------------------
+// Site profiles
+//
+// Known sites get their own rules, chosen per page by its URL, instead of
+// every page being tried against every generic pattern. A profiles file
+// holds one block per site:
+//
+//   site          example-shop
+//   host          example.com www.example.com *.example.org
+//   prefix        https://partner.example.net/shop/
+//   price-format  decimal-comma EUR
+//   container     element  div  class  product item
+//   name          element  h2   class  title
+//   price         amount   €
+//
+// Lines other than site / host / prefix / price-format / rules are rules in
+// the ExtractionRules language; "rules FILE" takes them from a file instead
+// (relative to the profiles file). price-format is "decimal-point" (the
+// default) or "decimal-comma" ("1.299,00"), optionally followed by the
+// currency to assume when a price shows none.
+//
+// A page is matched by the longest URL prefix, then its exact host, then
+// the closest "*." wildcard; a page matching nothing keeps the scraper's
+// own rules. Hosts and prefixes go into hash tables when the file is
+// loaded, so picking a profile costs a few lookups however many sites are
+// listed. SiteProfiles re-reads the file when it changes on disk.
+// ---------------------------------------------------------------------------
+
+struct SiteProfile {
+    string name;
+    shared_ptr<const ExtractionRules> rules;
+    bool decimalComma = false;
+    Currency currency = Currency::Unknown;   // assumed when a price shows none
+
+    bool rewritesPrices() const { return decimalComma || currency != Currency::Unknown; }
+
+    // Re-read a product's price in this site's format
+    void applyPriceFormat(ProductView& product) const {
+        if (decimalComma) {
+            string swapped(product.price);
+            for (char& c : swapped) {
+                if (c == '.') c = ',';
+                else if (c == ',') c = '.';
+            }
+            Money amount = parsePrice(swapped);
+            amount.currency = detectCurrency(product.price);
+            product.amount = amount;
+        }
+        if (product.amount.valid && product.amount.currency == Currency::Unknown) product.amount.currency = currency;
+    }
+
+    // Settings besides the rules that change extracted products
+    string description() const {
+        return string("site ") + name + (decimalComma ? " decimal-comma " : " decimal-point ") + currencyCode(currency);
+    }
+};
+
+// Every profile of one profiles file, with its lookup tables; immutable
+class ProfileSet {
+public:
+    // Throws runtime_error naming the file and line of a malformed entry
+    static shared_ptr<const ProfileSet> load(const string& filename) {
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) throw runtime_error("Could not open profiles file " + filename);
+        shared_ptr<ProfileSet> set(new ProfileSet());
+        filesystem::path directory = filesystem::path(filename).parent_path();
+
+        struct Pending {
+            SiteProfile profile;
+            string rulesText;       // inline rules, padded to keep file line numbers
+            string rulesFile;
+            bool inlineRules = false;
+            int line = 0;
+        };
+        vector<Pending> blocks;
+        auto fail = [&](int line, const string& message) {
+            throw runtime_error(filename + ":" + to_string(line) + ": " + message);
+        };
+
+        string line;
+        int lineNumber = 0;
+        while (getline(file, line)) {
+            lineNumber++;
+            string text = line;
+            size_t comment = text.find('#');
+            if (comment != string::npos) text.erase(comment);
+            istringstream words(text);
+            vector<string> args;
+            string word;
+            while (words >> word) args.push_back(word);
+
+            if (!args.empty() && args[0] == "site") {
+                if (args.size() != 2) fail(lineNumber, "expected: site NAME");
+                blocks.push_back(Pending());
+                blocks.back().profile.name = args[1];
+                blocks.back().line = lineNumber;
+                continue;
+            }
+            if (args.empty()) {
+                if (!blocks.empty()) blocks.back().rulesText += '\n';
+                continue;
+            }
+            if (blocks.empty()) fail(lineNumber, "expected a site line first");
+            Pending& block = blocks.back();
+            size_t index = blocks.size() - 1;
+
+            if (args[0] == "host") {
+                if (args.size() < 2) fail(lineNumber, "expected: host NAME...");
+                for (size_t i = 1; i < args.size(); i++) {
+                    string host = lowerAscii(args[i]);
+                    bool wildcard = host.compare(0, 2, "*.") == 0;
+                    auto& table = wildcard ? set->wildcards : set->hosts;
+                    if (!table.emplace(wildcard ? host.substr(2) : host, index).second) {
+                        fail(lineNumber, "host " + args[i] + " is already listed");
+                    }
+                }
+            } else if (args[0] == "prefix") {
+                if (args.size() < 2) fail(lineNumber, "expected: prefix URL...");
+                for (size_t i = 1; i < args.size(); i++) {
+                    if (!set->prefixes.emplace(args[i], index).second) fail(lineNumber, "prefix " + args[i] + " is already listed");
+                }
+            } else if (args[0] == "price-format") {
+                if (args.size() < 2 || args.size() > 3) fail(lineNumber, "expected: price-format decimal-point|decimal-comma [CURRENCY]");
+                if (args[1] == "decimal-comma") block.profile.decimalComma = true;
+                else if (args[1] != "decimal-point") fail(lineNumber, "unknown price format " + args[1]);
+                if (args.size() == 3) {
+                    block.profile.currency = detectCurrency(args[2]);
+                    if (block.profile.currency == Currency::Unknown) fail(lineNumber, "unknown currency " + args[2]);
+                }
+            } else if (args[0] == "rules") {
+                if (args.size() != 2) fail(lineNumber, "expected: rules FILE");
+                filesystem::path rulesPath(args[1]);
+                block.rulesFile = rulesPath.is_absolute() ? args[1] : (directory / rulesPath).string();
+            } else {
+                block.inlineRules = true;
+                block.rulesText += line;
+            }
+            // One line of rules text per file line, so rule errors report file lines
+            block.rulesText += '\n';
+        }
+
+        for (size_t i = 0; i < blocks.size(); i++) {
+            Pending& block = blocks[i];
+            if (block.inlineRules && !block.rulesFile.empty()) {
+                fail(block.line, "site " + block.profile.name + " has both a rules file and inline rules");
+            }
+            try {
+                if (block.rulesFile.empty()) {
+                    string padded(static_cast<size_t>(block.line), '\n');
+                    block.profile.rules = ExtractionRules::compile(padded + block.rulesText, filename);
+                } else {
+                    block.profile.rules = ExtractionRules::fromFile(block.rulesFile);
+                }
+            } catch (const exception& e) {
+                throw runtime_error(string(e.what()) + " (site " + block.profile.name + ")");
+            }
+            set->profiles.push_back(move(block.profile));
+        }
+
+        // Longest prefixes are tried first
+        for (const auto& entry : set->prefixes) set->prefixLengths.push_back(entry.first.size());
+        sort(set->prefixLengths.begin(), set->prefixLengths.end(), greater<size_t>());
+        set->prefixLengths.erase(unique(set->prefixLengths.begin(), set->prefixLengths.end()), set->prefixLengths.end());
+        return set;
+    }
+
+    // Profile for a page URL, or null
+    const SiteProfile* find(string_view url) const {
+        for (size_t length : prefixLengths) {
+            if (length > url.size()) continue;
+            auto found = prefixes.find(string(url.substr(0, length)));
+            if (found != prefixes.end()) return &profiles[found->second];
+        }
+
+        UrlNormalizer::Parts parts = UrlNormalizer::split(url);
+        if (!parts.hasAuthority) return nullptr;
+        string_view authority = parts.authority;
+        size_t at = authority.rfind('@');
+        if (at != string_view::npos) authority.remove_prefix(at + 1);
+        size_t colon = authority.rfind(':');
+        if (colon != string_view::npos && authority.find(']', colon) == string_view::npos) authority = authority.substr(0, colon);
+        string host = lowerAscii(authority);
+
+        auto found = hosts.find(host);
+        if (found != hosts.end()) return &profiles[found->second];
+        for (size_t dot = host.find('.'); dot != string::npos; dot = host.find('.', dot + 1)) {
+            found = wildcards.find(host.substr(dot + 1));
+            if (found != wildcards.end()) return &profiles[found->second];
+        }
+        return nullptr;
+    }
+
+    const vector<SiteProfile>& all() const { return profiles; }
+
+private:
+    vector<SiteProfile> profiles;
+    unordered_map<string, size_t> hosts;       // exact host -> profile
+    unordered_map<string, size_t> wildcards;   // "*.example.org" stored as "example.org"
+    unordered_map<string, size_t> prefixes;
+    vector<size_t> prefixLengths;              // distinct prefix lengths, longest first
+
+    static string lowerAscii(string_view text) {
+        string lower(text);
+        for (char& c : lower) {
+            if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+        }
+        return lower;
+    }
+};
+
+// The profiles of a file, re-read when the file's modification time
+// changes. Checks happen at most once per interval, from whichever thread
+// asks for the profiles next; a file that fails to load is reported and
+// the previous profiles stay in use.
+class SiteProfiles {
+public:
+    // Throws runtime_error when the file cannot be loaded the first time.
+    // An interval of zero never reloads.
+    SiteProfiles(string profilesFile, chrono::milliseconds checkInterval,
+                 shared_ptr<const Logger> messageLogger = make_shared<Logger>())
+        : filename(move(profilesFile)), interval(checkInterval), logger(move(messageLogger)) {
+        profiles = ProfileSet::load(filename);
+        modified = modificationTime();
+        lastCheck = chrono::steady_clock::now();
+    }
+
+    shared_ptr<const ProfileSet> current() {
+        lock_guard<mutex> guard(lock);
+        if (interval.count() > 0 && chrono::steady_clock::now() - lastCheck >= interval) {
+            lastCheck = chrono::steady_clock::now();
+            auto stamp = modificationTime();
+            if (stamp != modified) {
+                modified = stamp;
+                try {
+                    profiles = ProfileSet::load(filename);
+                    reloadCount++;
+                    logger->info() << "Reloaded " << profiles->all().size() << " site profiles from " << filename;
+                } catch (const exception& e) {
+                    logger->warning() << e.what() << " (keeping the previous profiles)";
+                }
+            }
+        }
+        return profiles;
+    }
+
+    size_t reloads() const {
+        lock_guard<mutex> guard(lock);
+        return reloadCount;
+    }
+
+private:
+    string filename;
+    chrono::milliseconds interval;
+    shared_ptr<const Logger> logger;
+    mutable mutex lock;
+    shared_ptr<const ProfileSet> profiles;
+    filesystem::file_time_type modified;
+    chrono::steady_clock::time_point lastCheck;
+    size_t reloadCount = 0;
+
+    filesystem::file_time_type modificationTime() const {
+        error_code error;
+        auto stamp = filesystem::last_write_time(filename, error);
+        return error ? filesystem::file_time_type() : stamp;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Work-stealing thread pool
+//
+// Every worker owns a task deque. Submitted tasks are spread round-robin;
+// a worker takes from the front of its own deque and, when that is empty,
+// steals from the front of the others, so a few large files cannot leave
+// the remaining cores idle. Taking from the front everywhere runs tasks
+// roughly in submission order, which lets callers that merge results in
+// order (processBatch) write them out as they go.
+// ---------------------------------------------------------------------------
+
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threadCount) {
+        if (threadCount == 0) threadCount = 1;
+        for (unsigned i = 0; i < threadCount; i++) workers.emplace_back(new Worker());
+        for (unsigned i = 0; i < threadCount; i++) threads.emplace_back([this, i] { run(i); });
+    }
+
+    ~ThreadPool() {
+        wait();
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : threads) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(function<void()> task) {
+        pending++;
+        Worker& worker = *workers[nextWorker++ % workers.size()];
+        {
+            lock_guard<mutex> guard(worker.lock);
+            worker.tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void wait() {
+        unique_lock<mutex> guard(sleepLock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+private:
+    struct Worker {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<size_t> pending{0};
+    atomic<size_t> nextWorker{0};
+    size_t queued = 0;         // guarded by sleepLock
+    bool stopping = false;     // guarded by sleepLock
+    mutex sleepLock;
+    condition_variable wake;
+    condition_variable idle;
+
+    bool tryPop(unsigned self, function<void()>& task) {
+        const size_t count = workers.size();
+        for (size_t offset = 0; offset < count; offset++) {
+            Worker& worker = *workers[(self + offset) % count];
+            lock_guard<mutex> guard(worker.lock);
+            if (worker.tasks.empty()) continue;
+            task = move(worker.tasks.front());
+            worker.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void run(unsigned self) {
+        while (true) {
+            {
+                unique_lock<mutex> guard(sleepLock);
+                wake.wait(guard, [this] { return stopping || queued > 0; });
+                if (queued == 0) return;
+                queued--;
+            }
+
+            // A queued task is reserved for us; it may sit in any deque
+            function<void()> task;
+            while (!tryPop(self, task)) this_thread::yield();
+            task();
+
+            if (--pending == 0) {
+                lock_guard<mutex> guard(sleepLock);
+                idle.notify_all();
+            }
+        }
+    }
+};
+
+// Match a file name against a pattern with '*' and '?' wildcards
+bool wildcardMatch(string_view name, string_view pattern) {
+    size_t n = 0, p = 0, starP = string_view::npos, starN = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            n++;
+            p++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starN = n;
+        } else if (starP != string_view::npos) {
+            p = starP + 1;
+            n = ++starN;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+// Run the name, price, rating and URL rules over a single container.
+// `evaluate(rule)` returns a field rule's raw match and `findLink(href)`
+// the container's first link, so the token and DOM engines pick, clean and
+// count fields the same way. `scratch` is reused for cleaned text between
+// calls; `counters` (null when metrics are off) follows
+// ExtractionRules::counters(); `urls` says how the product link is
+// normalized.
+template <typename Evaluate, typename FindLink>
+ProductView extractFields(const TokenRuleSet& tokenRules, ProductBatch& batch, pmr::string& scratch,
+                          RuleCounters* counters, const UrlContext& urls, Evaluate&& evaluateRule,
+                          FindLink&& findLink) {
+    StageTimer timer(Metrics::FieldExtraction);
+    ProductView product;
+
+    // Cleaned text is either the match itself or a rewrite in scratch;
+    // only rewrites need to be copied into the batch
+    auto keep = [&batch](string_view match, string_view cleaned) {
+        return cleaned.data() == match.data() ? cleaned : batch.store(cleaned);
+    };
+    auto clean = [&scratch](string_view match) {
+        StageTimer cleanTimer(Metrics::Clean);
+        return cleanTextView(match, scratch);
+    };
+    auto evaluate = [&](const FieldRule& rule, RuleCounters* counter) {
+        if (!counter) return evaluateRule(rule);
+        auto started = chrono::steady_clock::now();
+        string_view match = evaluateRule(rule);
+        counter->attempt(started);
+        return match;
+    };
+    RuleCounters* nameCounters = counters ? counters + tokenRules.containers.size() : nullptr;
+    RuleCounters* priceCounters = nameCounters ? nameCounters + tokenRules.names.size() : nullptr;
+    RuleCounters* ratingCounters = priceCounters ? priceCounters + tokenRules.prices.size() : nullptr;
+
+    // Extract name
+    for (size_t i = 0; i < tokenRules.names.size(); i++) {
+        RuleCounters* counter = nameCounters ? nameCounters + i : nullptr;
+        string_view match = evaluate(tokenRules.names[i], counter);
+        if (match.empty()) continue;
+        string_view candidateName = clean(match);
+        if (candidateName.length() > 5 && candidateName.length() < 200) {
+            product.name = keep(match, candidateName);
+            if (counter) counter->hit();
+            break;
+        }
+    }
+
+    // Extract price
+    for (size_t i = 0; i < tokenRules.prices.size(); i++) {
+        RuleCounters* counter = priceCounters ? priceCounters + i : nullptr;
+        string_view match = evaluate(tokenRules.prices[i], counter);
+        if (match.empty()) continue;
+        product.price = keep(match, clean(match));
+        if (!product.price.empty()) {
+            if (counter) counter->hit();
+            break;
+        }
+    }
+
+    // Extract rating
+    for (size_t i = 0; i < tokenRules.ratings.size(); i++) {
+        RuleCounters* counter = ratingCounters ? ratingCounters + i : nullptr;
+        string_view match = evaluate(tokenRules.ratings[i], counter);
+        if (!match.empty()) {
+            product.rating = keep(match, clean(match));
+            if (counter) counter->hit();
+            break;
+        }
+    }
+
+    // Extract URL from the first link carrying an href
+    string_view href;
+    if (findLink(href)) {
+        if (urls.normalizer) {
+            urls.normalizer->normalize(href, urls.base, scratch);
+            product.url = scratch == href ? href : batch.store(scratch);
+        } else {
+            product.url = href;
+        }
+    }
+
+    product.parseValues();
+    return product;
+}
+
+// Fields of the container whose tokens are [first, last) and whose inner
+// markup is `content`
+ProductView extractProductFields(const TokenRuleSet& tokenRules, string_view source, const TokenList& tokens,
+                                size_t first, size_t last, string_view content, ProductBatch& batch,
+                                pmr::string& scratch, RuleCounters* counters = nullptr,
+                                const UrlContext& urls = UrlContext()) {
+    return extractFields(tokenRules, batch, scratch, counters, urls,
+        [&](const FieldRule& rule) { return evaluateFieldRule(rule, source, tokens, first, last, content); },
+        [&](string_view& href) {
+            for (size_t i = first; i < last; i++) {
+                if (tokens[i].kind == HtmlToken::Open && equalsIgnoreCase(tokens[i].name(source), "a") &&
+                    findAttribute(tokens[i].attributes(source), "href", href)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+}
+
+// ---------------------------------------------------------------------------
+// Container scheduling
+//
+// Evaluates every container rule in a single pass over the token stream.
+// Open candidates form a stack; a nested match is only tracked when it is
+// more specific than the candidate enclosing it, and an enclosing candidate
+// that already produced a product through a nested one is dropped. The
+// result is one product per real container with cost O(tokens).
+// ---------------------------------------------------------------------------
+
+class ContainerScheduler {
+public:
+    // `ruleCounters` (null when metrics are off) follows ExtractionRules::counters()
+    explicit ContainerScheduler(const TokenRuleSet& tokenRules, RuleCounters* ruleCounters = nullptr,
+                                pmr::memory_resource* memory = pmr::get_default_resource())
+        : rules(tokenRules), counters(ruleCounters), stack(memory) {}
+
+    // Feed tokens[index]. When a candidate container closes, calls
+    // onContainer(rule, openIndex, closeIndex), which returns true when the
+    // container held a product.
+    template <typename OnContainer>
+    void push(string_view source, const TokenList& tokens, size_t index, OnContainer&& onContainer) {
+        const HtmlToken& token = tokens[index];
+        if (token.kind == HtmlToken::Open && token.selfClosing) return;
+        string_view name = token.name(source);
+
+        if (token.kind == HtmlToken::Open) {
+            for (auto& candidate : stack) {
+                if (equalsIgnoreCase(name, candidate.tag)) candidate.depth++;
+            }
+            openCandidate(source, token, index, name);
+            return;
+        }
+
+        // Close tag: find the outermost candidate it completes. Candidates
+        // above it were never terminated and are discarded.
+        size_t closed = stack.size();
+        for (size_t i = 0; i < stack.size(); i++) {
+            if (equalsIgnoreCase(name, stack[i].tag) && --stack[i].depth == 0 && closed == stack.size()) {
+                closed = i;
+            }
+        }
+        if (closed == stack.size()) return;
+
+        Candidate candidate = stack[closed];
+        stack.resize(closed);
+        if (candidate.superseded) return;
+
+        if (onContainer(candidate.rule, candidate.openIndex, index)) {
+            for (auto& enclosing : stack) enclosing.superseded = true;
+            if (counters) counters[candidate.rule].hit();
+        }
+    }
+
+    bool active() const { return !stack.empty(); }
+    size_t outermostOpenIndex() const { return stack.front().openIndex; }
+    void reset() { stack.clear(); }
+
+    // Token indices moved down by `count` (streaming compaction)
+    void shiftIndices(size_t count) {
+        for (auto& candidate : stack) candidate.openIndex -= count;
+    }
+
+private:
+    struct Candidate {
+        size_t rule;
+        size_t openIndex;
+        int specificity;
+        int depth;
+        bool superseded;
+        string tag;
+    };
+
+    const TokenRuleSet& rules;
+    RuleCounters* counters;
+    pmr::vector<Candidate> stack;
+
+    bool matches(size_t rule, string_view source, const HtmlToken& token) {
+        if (!counters) return rules.containers[rule].matches(source, token);
+        auto started = chrono::steady_clock::now();
+        bool matched = rules.containers[rule].matches(source, token);
+        counters[rule].attempt(started);
+        return matched;
+    }
+
+    void openCandidate(string_view source, const HtmlToken& token, size_t index, string_view name) {
+        const vector<size_t>* candidates = rules.containerRulesFor(name);
+        if (!candidates) return;
+
+        // Most specific matching rule; the earlier rule wins a tie
+        size_t best = SIZE_MAX;
+        int bestScore = -1;
+        for (size_t rule : *candidates) {
+            int score = rules.containers[rule].specificity();
+            if (score > bestScore && matches(rule, source, token)) {
+                best = rule;
+                bestScore = score;
+            }
+        }
+        if (best == SIZE_MAX) return;
+        if (!stack.empty() && stack.back().specificity >= bestScore) return;
+
+        stack.push_back(Candidate{best, index, bestScore, 1, false, string(name)});
+    }
+};
+
+// Set of 64-bit fingerprints (open addressing), used to drop repeated
+// products without keeping their strings
+class FingerprintSet {
+public:
+    explicit FingerprintSet(pmr::memory_resource* memory = pmr::get_default_resource()) : slots(memory) {}
+
+    // Returns false when the fingerprint was already present
+    bool insert(uint64_t fingerprint) {
+        if (fingerprint == 0) fingerprint = 1;
+        if ((count + 1) * 2 > slots.size()) grow();
+        size_t mask = slots.size() - 1;
+        for (size_t i = static_cast<size_t>(fingerprint) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == fingerprint) return false;
+            if (slots[i] == 0) {
+                slots[i] = fingerprint;
+                count++;
+                return true;
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+    void clear() { slots.clear(); count = 0; }
+
+private:
+    pmr::vector<uint64_t> slots;
+    size_t count = 0;
+
+    void grow() {
+        pmr::vector<uint64_t> old = move(slots);
+        slots.assign(old.empty() ? 64 : old.size() * 2, 0);
+        count = 0;
+        for (uint64_t value : old) {
+            if (value) insert(value);
+        }
+    }
+};
+
+// Products are the same when their URLs match, or, without a URL, their names
+inline uint64_t productFingerprint(const ProductView& product) {
+    uint64_t h = product.url.empty() ? hash<string_view>()(product.name) ^ 0x9E3779B97F4A7C15ull
+                                     : hash<string_view>()(product.url);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline bool isMeaningfulProduct(const ProductView& product) {
+    return !product.name.empty() && (!product.price.empty() || !product.rating.empty());
+}
+
+// ---------------------------------------------------------------------------
+// DOM extraction
+//
+// The second engine evaluates the same rule tables over a DomTree instead
+// of the raw token list. Element rules become selectors (TagRule::selector),
+// and elements are delimited by their paired end tag instead of the next
+// end tag with the same name. Containers are chosen the same way as in
+// ContainerScheduler. A rule set that uses css rules needs this engine.
+// ---------------------------------------------------------------------------
+
+enum class ExtractionEngine { Tokens, Dom };
+
+inline ExtractionEngine parseExtractionEngine(const string& name) {
+    if (name == "tokens") return ExtractionEngine::Tokens;
+    if (name == "dom") return ExtractionEngine::Dom;
+    throw invalid_argument("unknown engine '" + name + "' (expected tokens or dom)");
+}
+
+// evaluateFieldRule for the container `node` of `tree`
+string_view evaluateDomFieldRule(const FieldRule& rule, const DomTree& tree, uint32_t node) {
+    const DomTree::Node& container = tree.node(node);
+    switch (rule.kind) {
+        case FieldRule::Element:
+        case FieldRule::Selector:
+        case FieldRule::NumericElement:
+            for (uint32_t i = node + 1; i < container.end; i++) {
+                const DomTree::Node& candidate = tree.node(i);
+                if (!candidate.closed || !rule.element.selector.matches(tree, i)) continue;
+                string_view text = tree.inner(i);
+                if (rule.kind != FieldRule::NumericElement) return text;
+
+                // A lone number: no child elements, only number characters
+                if (candidate.end != i + 1 || text.empty()) continue;
+                bool numeric = true;
+                for (char c : text) numeric = numeric && textscan::isNumberChar(c);
+                if (numeric) return text;
+            }
+            return string_view();
+        default:
+            return evaluateTextRule(rule, tree.inner(node));
+    }
+}
+
+ProductView extractDomProductFields(const TokenRuleSet& tokenRules, const DomTree& tree, uint32_t node,
+                                   ProductBatch& batch, pmr::string& scratch, RuleCounters* counters = nullptr,
+                                   const UrlContext& urls = UrlContext()) {
+    return extractFields(tokenRules, batch, scratch, counters, urls,
+        [&](const FieldRule& rule) { return evaluateDomFieldRule(rule, tree, node); },
+        [&](string_view& href) {
+            for (uint32_t i = node + 1; i < tree.node(node).end; i++) {
+                if (equalsIgnoreCase(tree.name(i), "a") && tree.attribute(i, "href", href)) return true;
+            }
+            return false;
+        });
+}
+
+// ContainerScheduler over a DomTree. Nodes are visited in document order;
+// a candidate is resolved once the walk passes its last descendant, so
+// products come out in end-tag order, as from the token engine.
+class DomContainerWalker {
+public:
+    // `ruleCounters` (null when metrics are off) follows ExtractionRules::counters()
+    explicit DomContainerWalker(const TokenRuleSet& tokenRules, RuleCounters* ruleCounters = nullptr,
+                                pmr::memory_resource* memory = pmr::get_default_resource())
+        : rules(tokenRules), counters(ruleCounters), stack(memory) {}
+
+    // Visit node `index`. Calls onContainer(rule, node) for every candidate
+    // that ends before it; onContainer returns true when the container held
+    // a product.
+    template <typename OnContainer>
+    void visit(const DomTree& tree, uint32_t index, OnContainer&& onContainer) {
+        resolveBefore(tree, index, onContainer);
+        if (!tree.node(index).closed) return;
+
+        // Most specific matching rule; the earlier rule wins a tie
+        string_view name = tree.name(index);
+        size_t best = SIZE_MAX;
+        int bestScore = -1;
+        for (size_t rule = 0; rule < rules.containers.size(); rule++) {
+            const TagRule& container = rules.containers[rule];
+            if (!container.css && !container.matchesTag(name)) continue;
+            int score = container.specificity();
+            if (score > bestScore && matches(rule, tree, index)) {
+                best = rule;
+                bestScore = score;
+            }
+        }
+        if (best == SIZE_MAX) return;
+        if (!stack.empty() && stack.back().specificity >= bestScore) return;
+
+        stack.push_back(Candidate{best, index, bestScore, false});
+    }
+
+    // Resolve the candidates still open at the end of the document
+    template <typename OnContainer>
+    void finish(const DomTree& tree, OnContainer&& onContainer) {
+        resolveBefore(tree, tree.size(), onContainer);
+    }
+
+private:
+    struct Candidate {
+        size_t rule;
+        uint32_t node;
+        int specificity;
+        bool superseded;
+    };
+
+    const TokenRuleSet& rules;
+    RuleCounters* counters;
+    pmr::vector<Candidate> stack;
+
+    bool matches(size_t rule, const DomTree& tree, uint32_t node) {
+        if (!counters) return rules.containers[rule].selector.matches(tree, node);
+        auto started = chrono::steady_clock::now();
+        bool matched = rules.containers[rule].selector.matches(tree, node);
+        counters[rule].attempt(started);
+        return matched;
+    }
+
+    template <typename OnContainer>
+    void resolveBefore(const DomTree& tree, uint32_t index, OnContainer& onContainer) {
+        while (!stack.empty() && tree.node(stack.back().node).end <= index) {
+            Candidate candidate = stack.back();
+            stack.pop_back();
+            if (candidate.superseded) continue;
+            if (onContainer(candidate.rule, candidate.node)) {
+                for (auto& enclosing : stack) enclosing.superseded = true;
+                if (counters) counters[candidate.rule].hit();
+            }
+        }
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Streaming extraction
+//
+// Takes the document in blocks of any size and emits each product as soon
+// as its container's end tag arrives. Only the unconsumed tail of the input
+// is buffered: nothing when outside a container, otherwise the outermost
+// open container from its start tag on. A container that grows past the
+// memory budget is dropped, so memory stays bounded whatever the input size.
+//
+// Containers are resolved by the same ContainerScheduler as the in-memory
+// path, so both produce the same products.
+// ---------------------------------------------------------------------------
+
+class StreamingExtractor {
+public:
+    using ProductCallback = function<void(const ProductView&)>;
+
+    StreamingExtractor(shared_ptr<const ExtractionRules> extractionRules, ProductCallback callback,
+                       size_t memoryBudget = 64u << 20)
+        : rules(move(extractionRules)), onProduct(move(callback)), budget(memoryBudget),
+          counters(Metrics::instance().countersFor(*rules)), scheduler(rules->tokens(), counters) {}
+
+    void feed(string_view block) {
+        StageTimer timer(Metrics::ContainerMatch);
+        compact();
+        pending.append(block.data(), block.size());
+        peakBuffer = max(peakBuffer, pending.capacity());
+        process(false);
+        enforceBudget();
+    }
+
+    // Normalize product links (see UrlNormalizer), resolving them against
+    // baseUrl or a <base href> in the document
+    void setUrls(const UrlNormalizer* urlNormalizer, string baseUrl) {
+        normalizer = urlNormalizer;
+        documentUrl = move(baseUrl);
+    }
+
+    // Flush whatever is left; an unterminated container is discarded
+    void finish() {
+        StageTimer timer(Metrics::ContainerMatch);
+        process(true);
+        if (scheduler.active()) dropped++;
+        scheduler.reset();
+        containerTokens.clear();
+        pending.clear();
+        pending.shrink_to_fit();
+        scanPos = 0;
+    }
+
+    size_t productCount() const { return emitted; }
+    size_t duplicateCount() const { return duplicates; }
+    size_t droppedContainers() const { return dropped; }
+    size_t peakBufferBytes() const { return peakBuffer; }
+
+private:
+    enum class State { Text, Comment, RawText };
+
+    shared_ptr<const ExtractionRules> rules;
+    ProductCallback onProduct;
+    size_t budget;
+    RuleCounters* counters;
+
+    string pending;        // input not yet consumed
+    size_t scanPos = 0;    // next byte of `pending` to look at
+    State state = State::Text;
+    string rawTextTag;     // script/style whose end tag we are looking for
+
+    ContainerScheduler scheduler;
+    TokenList containerTokens;   // tokens since the outermost open container began
+    ProductBatch scratch;
+    pmr::string cleanScratch;
+    FingerprintSet seen;
+    const UrlNormalizer* normalizer = nullptr;
+    string documentUrl;
+    bool baseSeen = false;
+
+    size_t emitted = 0;
+    size_t duplicates = 0;
+    size_t dropped = 0;
+    size_t peakBuffer = 0;
+
+    // Drop consumed input; token offsets move with the buffer
+    void compact() {
+        size_t keep = scheduler.active() ? containerTokens[0].begin : scanPos;
+        if (keep == 0) return;
+        pending.erase(0, keep);
+        scanPos -= keep;
+        for (auto& token : containerTokens) {
+            token.begin -= keep;
+            token.end -= keep;
+            token.nameBegin -= keep;
+        }
+    }
+
+    void enforceBudget() {
+        if (scheduler.active() && pending.size() - containerTokens[0].begin > budget) {
+            scheduler.reset();
+            containerTokens.clear();
+            dropped++;
+        }
+        compact();
+        if (pending.capacity() > budget && pending.size() < pending.capacity() / 4) {
+            pending.shrink_to_fit();
+        }
+    }
+
+    void process(bool atEnd) {
+        const size_t size = pending.size();
+        while (scanPos < size) {
+            if (state == State::Comment) {
+                size_t close = pending.find("-->", scanPos);
+                if (close == string::npos) {
+                    scanPos = max(scanPos, size >= 2 ? size - 2 : 0);
+                    return;
+                }
+                scanPos = close + 3;
+                state = State::Text;
+                continue;
+            }
+
+            if (state == State::RawText) {
+                size_t close = scanPos;
+                bool partial = false;
+                while ((close = pending.find("</", close)) != string::npos) {
+                    if (close + 2 + rawTextTag.size() > size) {
+                        partial = true;
+                        break;
+                    }
+                    if (equalsIgnoreCase(string_view(pending).substr(close + 2, rawTextTag.size()), rawTextTag)) break;
+                    close += 2;
+                }
+                if (close == string::npos) {
+                    scanPos = max(scanPos, size - 1);
+                    return;
+                }
+                scanPos = close;
+                if (partial) return;
+                state = State::Text;
+                continue;
+            }
+
+            const void* hit = memchr(pending.data() + scanPos, '<', size - scanPos);
+            if (!hit) {
+                scanPos = size;
+                return;
+            }
+            size_t lt = static_cast<const char*>(hit) - pending.data();
+
+            size_t consumed = scanToken(lt, atEnd);
+            if (consumed == 0) {
+                // Incomplete tag: wait for more input unless it can never complete
+                if (!atEnd && size - lt <= budget) {
+                    scanPos = lt;
+                    return;
+                }
+                consumed = lt + 1;
+            }
+            scanPos = consumed;
+        }
+    }
+
+    // Handle the markup starting at `lt`. Returns the offset just past it,
+    // or 0 when more input is needed to decide.
+    size_t scanToken(size_t lt, bool atEnd) {
+        string_view html(pending);
+        if (lt + 1 >= html.size()) return 0;
+
+        char next = html[lt + 1];
+        if (next == '!' || next == '?') {
+            if (next == '!' && html.size() - lt < 4 && !atEnd) return 0;
+            if (next == '!' && html.compare(lt, 4, "<!--") == 0) {
+                state = State::Comment;
+                return lt + 4;
+            }
+            size_t close = html.find('>', lt + 2);
+            return close == string_view::npos ? 0 : close + 1;
+        }
+
+        bool closing = next == '/';
+        size_t nameStart = lt + (closing ? 2 : 1);
+        if (nameStart >= html.size()) return 0;
+        if (!HtmlTokenizer::isTagNameStart(html[nameStart])) return lt + 1;
+        size_t nameEnd = nameStart;
+        while (nameEnd < html.size() && HtmlTokenizer::isTagNameChar(html[nameEnd])) nameEnd++;
+        if (nameEnd == html.size()) return 0;
+
+        size_t gt = HtmlTokenizer::findTagEnd(html, nameEnd);
+        if (gt == string_view::npos) return 0;
+
+        HtmlToken token;
+        token.kind = closing ? HtmlToken::Close : HtmlToken::Open;
+        token.begin = lt;
+        token.end = gt + 1;
+        token.nameBegin = nameStart;
+        token.nameLength = nameEnd - nameStart;
+        token.selfClosing = !closing && gt > nameEnd && html[gt - 1] == '/';
+
+        string_view name = token.name(html);
+        if (!closing && !token.selfClosing && (equalsIgnoreCase(name, "script") || equalsIgnoreCase(name, "style"))) {
+            state = State::RawText;
+            rawTextTag.assign(name.data(), name.size());
+        }
+
+        handleToken(token);
+        return gt + 1;
+    }
+
+    void handleToken(const HtmlToken& token) {
+        string_view html(pending);
+        string_view href;
+        if (normalizer && !baseSeen && findBaseHref(html, token, href)) {
+            documentUrl = normalizer->normalize(href, documentUrl);
+            baseSeen = true;
+        }
+        containerTokens.push_back(token);
+        scheduler.push(html, containerTokens, containerTokens.size() - 1, [&](size_t, size_t open, size_t close) {
+            string_view content = html.substr(containerTokens[open].end,
+                                              containerTokens[close].begin - containerTokens[open].end);
+            scratch.clear();
+            ProductView product = extractProductFields(rules->tokens(), html, containerTokens, open + 1,
+                                                       close, content, scratch, cleanScratch, counters,
+                                                       UrlContext{normalizer, documentUrl});
+            // Only emit products with meaningful data
+            if (!isMeaningfulProduct(product)) return false;
+            if (seen.insert(productFingerprint(product))) {
+                emitted++;
+                onProduct(product);
+            } else {
+                duplicates++;
+            }
+            return true;
+        });
+
+        // Outside any container nothing needs to be remembered
+        if (!scheduler.active()) containerTokens.clear();
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Output sinks
+//
+// Products are written one at a time as they are extracted. Each sink
+// formats straight into a large buffer that goes to the OS in a single
+// write once full. Output is written to "<file>.tmp" and renamed over the
+// real name only after a successful finish(), so a crash or error never
+// leaves a truncated file where a complete one is expected. The file name
+// "-" (stdout) and existing non-regular files such as /dev/null or a FIFO
+// are written in place instead.
+// ---------------------------------------------------------------------------
+
+class BufferedFileWriter {
+public:
+    // Throws runtime_error when the file cannot be created
+    explicit BufferedFileWriter(const string& filename, size_t bufferSize = 1u << 20)
+        : finalName(filename), tempName(filename + ".tmp"), capacity(bufferSize) {
+        error_code error;
+        direct = filename == "-" || (filesystem::exists(filename, error) && !filesystem::is_regular_file(filename, error));
+        if (filename == "-") {
+            file = stdout;
+            buffer.reserve(capacity);
+            return;
+        }
+        file = fopen(direct ? filename.c_str() : tempName.c_str(), "wb");
+        if (!file) {
+            throw runtime_error("Could not create file " + filename);
+        }
+        setvbuf(file, nullptr, _IONBF, 0);
+        buffer.reserve(capacity);
+    }
+
+    ~BufferedFileWriter() {
+        // Never committed: throw the partial output away
+        if (file && file != stdout) {
+            fclose(file);
+            if (!direct) remove(tempName.c_str());
+        }
+    }
+
+    BufferedFileWriter(const BufferedFileWriter&) = delete;
+    BufferedFileWriter& operator=(const BufferedFileWriter&) = delete;
+
+    // Formatting target; call flushIfFull() after appending
+    string& data() { return buffer; }
+
+    void write(string_view text) {
+        buffer.append(text.data(), text.size());
+        flushIfFull();
+    }
+
+    void flushIfFull() {
+        if (buffer.size() >= capacity) flush();
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+            throw runtime_error("Write failed for " + finalName);
+        }
+        written += buffer.size();
+        buffer.clear();
+        if (file == stdout && fflush(file) != 0) throw runtime_error("Write failed for stdout");
+    }
+
+    // Flush, sync to disk and move the file into place
+    void commit() {
+        flush();
+        if (direct) {
+            bool closed = file == stdout || fclose(file) == 0;
+            file = nullptr;
+            if (!closed) throw runtime_error("Could not finish writing " + finalName);
+            return;
+        }
+        fflush(file);
+#ifdef SCRAPER_HAVE_MMAP
+        fsync(fileno(file));
+#endif
+        bool closed = fclose(file) == 0;
+        file = nullptr;
+        error_code error;
+        if (closed) filesystem::rename(tempName, finalName, error);
+        if (!closed || error) {
+            remove(tempName.c_str());
+            throw runtime_error("Could not finish writing " + finalName);
+        }
+    }
+
+    const string& filename() const { return finalName; }
+    size_t bytesWritten() const { return written + buffer.size(); }
+
+private:
+    string finalName;
+    string tempName;
+    size_t capacity;
+    bool direct = false;   // no temporary file and rename
+    FILE* file = nullptr;
+    string buffer;
+    size_t written = 0;
+};
+
+// Append text as the body of a JSON string, escaping quotes, backslashes
+// and control characters
+inline void appendJSONString(string_view text, string& out) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        out.append(text.data() + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xF];
+        }
+    }
+    out.append(text.data() + run, text.size() - run);
+}
+
+class ProductSink {
+public:
+    virtual ~ProductSink() = default;
+    virtual void write(const ProductView& product) = 0;
+    // Complete the output; nothing is visible under the final name before this
+    virtual void finish() = 0;
+    virtual size_t count() const = 0;
+    virtual string description() const = 0;
+};
+
+class CsvSink : public ProductSink {
+public:
+    explicit CsvSink(const string& filename) : out(filename) {
+        out.write("Product Name,Price,Rating,URL\n");
+    }
+
+    void write(const ProductView& product) override {
+        string& line = out.data();
+        appendCSVField(product.name, line);
+        line += ',';
+        appendCSVField(product.price, line);
+        line += ',';
+        appendCSVField(product.rating, line);
+        line += ',';
+        appendCSVField(product.url, line);
+        line += '\n';
+        out.flushIfFull();
+        written++;
+    }
+
+    void finish() override { out.commit(); }
+    size_t count() const override { return written; }
+    string description() const override { return out.filename(); }
+
+private:
+    BufferedFileWriter out;
+    size_t written = 0;
+};
+
+// {"products": [...]} document, laid out like the original saveToJSON
+class JsonSink : public ProductSink {
+public:
+    explicit JsonSink(const string& filename) : out(filename) {
+        out.write("{\n  \"products\": [\n");
+    }
+
+    void write(const ProductView& product) override {
+        string& text = out.data();
+        if (written > 0) text += ",\n";
+        text += "    {\n      \"name\": \"";
+        appendJSONString(product.name, text);
+        text += "\",\n      \"price\": \"";
+        appendJSONString(product.price, text);
+        text += "\",\n      \"rating\": \"";
+        appendJSONString(product.rating, text);
+        text += "\",\n      \"url\": \"";
+        appendJSONString(product.url, text);
+        text += "\"\n    }";
+        out.flushIfFull();
+        written++;
+    }
+
+    void finish() override {
+        out.write(written > 0 ? "\n  ]\n}\n" : "  ]\n}\n");
+        out.commit();
+    }
+
+    size_t count() const override { return written; }
+    string description() const override { return out.filename(); }
+
+private:
+    BufferedFileWriter out;
+    size_t written = 0;
+};
+
+// One JSON object per line
+class NdjsonSink : public ProductSink {
+public:
+    explicit NdjsonSink(const string& filename) : out(filename) {}
+
+    // Page the following products came from, written as a "source" member
+    // when not empty
+    void setSource(string_view url) { source.assign(url.data(), url.size()); }
+
+    void write(const ProductView& product) override {
+        string& text = out.data();
+        text += "{\"name\":\"";
+        appendJSONString(product.name, text);
+        text += "\",\"price\":\"";
+        appendJSONString(product.price, text);
+        text += "\",\"rating\":\"";
+        appendJSONString(product.rating, text);
+        text += "\",\"url\":\"";
+        appendJSONString(product.url, text);
+        if (!source.empty()) {
+            text += "\",\"source\":\"";
+            appendJSONString(source, text);
+        }
+        text += "\"}\n";
+        out.flushIfFull();
+        written++;
+    }
+
+    // Hand everything written so far to the OS (to stdout readers, say)
+    void flush() { out.flush(); }
+
+    void finish() override { out.commit(); }
+    size_t count() const override { return written; }
+    string description() const override { return out.filename(); }
+
+private:
+    BufferedFileWriter out;
+    string source;
+    size_t written = 0;
+};
+
+// ---------------------------------------------------------------------------
+// Columnar output
+//
+// A .pcol file stores each field as its own column, so analytics jobs can
+// map it and read values in place instead of parsing CSV:
+//
+//   header   "PRODCOL1", uint32 version, uint32 byte-order mark 0x01020304
+//   columns  8-byte aligned, native byte order
+//              name / price / rating / url .offsets   uint64[rows + 1]
+//              name / price / rating / url .bytes     UTF-8 text
+//              price.minor        int64[rows]   (INT64_MIN: price not parsed)
+//              price.currency     uint8[rows]   (Currency)
+//              rating.hundredths  int32[rows]
+//   footer   one 48-byte entry per column: name[24], type, reserved,
+//            offset, length
+//   trailer  uint64 footer offset, uint64 rows, uint32 column count,
+//            uint32 reserved, "PRODCOL1"
+//
+// The writer spools every column to an anonymous temporary file and joins
+// them on finish(), so memory stays flat however many products it takes.
+// ---------------------------------------------------------------------------
+
+namespace columnar {
+    const char kMagic[8] = {'P', 'R', 'O', 'D', 'C', 'O', 'L', '1'};
+    const uint32_t kVersion = 1;
+    const uint32_t kByteOrderMark = 0x01020304;
+
+    enum ColumnType : uint32_t {
+        Offsets = 1,   // uint64
+        Bytes = 2,
+        Int64 = 3,
+        UInt8 = 4,
+        Int32 = 5
+    };
+
+    struct FooterEntry {
+        char name[24];
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Trailer {
+        uint64_t footerOffset;
+        uint64_t rows;
+        uint32_t columnCount;
+        uint32_t reserved;
+        char magic[8];
+    };
+
+    // Text columns in file order
+    const char* const kTextColumns[] = {"name", "price", "rating", "url"};
+}
+
+// Append-only byte stream kept in an anonymous temporary file
+class ColumnSpool {
+public:
+    ColumnSpool() : file(tmpfile()) {
+        if (!file) throw runtime_error("Could not create a temporary file");
+    }
+
+    ~ColumnSpool() { fclose(file); }
+
+    ColumnSpool(const ColumnSpool&) = delete;
+    ColumnSpool& operator=(const ColumnSpool&) = delete;
+
+    void append(const void* data, size_t size) {
+        buffer.append(static_cast<const char*>(data), size);
+        total += size;
+        if (buffer.size() >= kBufferSize) flush();
+    }
+
+    template <typename T>
+    void appendValue(T value) { append(&value, sizeof(value)); }
+
+    size_t size() const { return total; }
+
+    // Write everything spooled so far to out
+    void copyTo(BufferedFileWriter& out) {
+        flush();
+        rewind(file);
+        vector<char> chunk(1u << 20);
+        size_t got;
+        while ((got = fread(chunk.data(), 1, chunk.size(), file)) > 0) {
+            out.write(string_view(chunk.data(), got));
+        }
+        if (ferror(file)) throw runtime_error("Could not read back a temporary file");
+    }
+
+private:
+    static constexpr size_t kBufferSize = 256u << 10;
+
+    FILE* file;
+    string buffer;
+    size_t total = 0;
+
+    void flush() {
+        if (buffer.empty()) return;
+        if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+            throw runtime_error("Could not write a temporary file");
+        }
+        buffer.clear();
+    }
+};
+
+class ColumnarSink : public ProductSink {
+public:
+    explicit ColumnarSink(const string& filename) : out(filename) {
+        for (auto& column : text) column.offsets.appendValue<uint64_t>(0);
+    }
+
+    void write(const ProductView& product) override {
+        const string_view fields[] = {product.name, product.price, product.rating, product.url};
+        for (size_t i = 0; i < 4; i++) {
+            text[i].bytes.append(fields[i].data(), fields[i].size());
+            text[i].offsets.appendValue<uint64_t>(text[i].bytes.size());
+        }
+        priceMinor.appendValue<int64_t>(product.amount.valid ? product.amount.minorUnits : INT64_MIN);
+        currency.appendValue<uint8_t>(static_cast<uint8_t>(product.amount.currency));
+        rating.appendValue<int32_t>(product.ratingHundredths);
+        written++;
+    }
+
+    void finish() override {
+        out.write(string_view(columnar::kMagic, sizeof(columnar::kMagic)));
+        writeValue(columnar::kVersion);
+        writeValue(columnar::kByteOrderMark);
+
+        vector<columnar::FooterEntry> footer;
+        auto addColumn = [&](const string& name, columnar::ColumnType type, ColumnSpool& spool) {
+            out.write(string_view("\0\0\0\0\0\0\0", (8 - out.bytesWritten() % 8) % 8));
+            columnar::FooterEntry entry{};
+            strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+            entry.type = type;
+            entry.offset = out.bytesWritten();
+            entry.length = spool.size();
+            spool.copyTo(out);
+            footer.push_back(entry);
+        };
+        for (size_t i = 0; i < 4; i++) {
+            addColumn(string(columnar::kTextColumns[i]) + ".offsets", columnar::Offsets, text[i].offsets);
+            addColumn(string(columnar::kTextColumns[i]) + ".bytes", columnar::Bytes, text[i].bytes);
+        }
+        addColumn("price.minor", columnar::Int64, priceMinor);
+        addColumn("price.currency", columnar::UInt8, currency);
+        addColumn("rating.hundredths", columnar::Int32, rating);
+
+        out.write(string_view("\0\0\0\0\0\0\0", (8 - out.bytesWritten() % 8) % 8));
+        columnar::Trailer trailer{};
+        trailer.footerOffset = out.bytesWritten();
+        trailer.rows = written;
+        trailer.columnCount = static_cast<uint32_t>(footer.size());
+        memcpy(trailer.magic, columnar::kMagic, sizeof(trailer.magic));
+        for (const auto& entry : footer) writeValue(entry);
+        writeValue(trailer);
+        out.commit();
+    }
+
+    size_t count() const override { return written; }
+    string description() const override { return out.filename(); }
+
+private:
+    struct TextColumn {
+        ColumnSpool offsets;
+        ColumnSpool bytes;
+    };
+
+    BufferedFileWriter out;
+    TextColumn text[4];
+    ColumnSpool priceMinor;
+    ColumnSpool currency;
+    ColumnSpool rating;
+    size_t written = 0;
+
+    template <typename T>
+    void writeValue(const T& value) {
+        out.write(string_view(reinterpret_cast<const char*>(&value), sizeof(value)));
+    }
+};
+
+// Read-only view of a .pcol file. The file is memory-mapped and every
+// accessor reads from the mapping, so opening costs the same for ten rows
+// or ten million.
+class ProductColumns {
+public:
+    // Throws runtime_error when the file is missing or not a valid .pcol file
+    static shared_ptr<const ProductColumns> open(const string& filename) {
+        shared_ptr<ProductColumns> columns(new ProductColumns());
+        columns->file = HtmlSource::open(filename);
+        columns->load(filename);
+        return columns;
+    }
+
+    size_t size() const { return rows; }
+
+    string_view name(size_t row) const { return textAt(0, row); }
+    string_view price(size_t row) const { return textAt(1, row); }
+    string_view rating(size_t row) const { return textAt(2, row); }
+    string_view url(size_t row) const { return textAt(3, row); }
+
+    // Whole numeric columns, size() entries each
+    const int64_t* priceMinorUnits() const { return priceMinor; }
+    const uint8_t* currencies() const { return currency; }
+    const int32_t* ratingHundredths() const { return ratings; }
+
+    // One row as a ProductView pointing into the mapping
+    ProductView row(size_t index) const {
+        ProductView product;
+        product.name = name(index);
+        product.price = price(index);
+        product.rating = rating(index);
+        product.url = url(index);
+        product.amount.valid = priceMinor[index] != INT64_MIN;
+        product.amount.minorUnits = product.amount.valid ? priceMinor[index] : 0;
+        product.amount.currency = static_cast<Currency>(currency[index]);
+        product.ratingHundredths = ratings[index];
+        return product;
+    }
+
+private:
+    struct TextColumn {
+        const uint64_t* offsets = nullptr;
+        const char* bytes = nullptr;
+        uint64_t length = 0;
+    };
+
+    shared_ptr<const HtmlSource> file;
+    size_t rows = 0;
+    TextColumn text[4];
+    const int64_t* priceMinor = nullptr;
+    const uint8_t* currency = nullptr;
+    const int32_t* ratings = nullptr;
+
+    ProductColumns() = default;
+
+    string_view textAt(size_t column, size_t row) const {
+        const TextColumn& values = text[column];
+        uint64_t begin = values.offsets[row];
+        uint64_t end = values.offsets[row + 1];
+        if (begin > end || end > values.length) return string_view();
+        return string_view(values.bytes + begin, end - begin);
+    }
+
+    void load(const string& filename) {
+        string_view data = file->view();
+        auto fail = [&](const string& why) {
+            throw runtime_error(filename + ": " + why);
+        };
+
+        const size_t headerSize = sizeof(columnar::kMagic) + 2 * sizeof(uint32_t);
+        if (data.size() < headerSize + sizeof(columnar::Trailer) ||
+            memcmp(data.data(), columnar::kMagic, sizeof(columnar::kMagic)) != 0) {
+            fail("not a columnar product file");
+        }
+        uint32_t version, byteOrder;
+        memcpy(&version, data.data() + 8, sizeof(version));
+        memcpy(&byteOrder, data.data() + 12, sizeof(byteOrder));
+        if (byteOrder != columnar::kByteOrderMark) fail("written with a different byte order");
+        if (version != columnar::kVersion) fail("unsupported version " + to_string(version));
+
+        columnar::Trailer trailer;
+        memcpy(&trailer, data.data() + data.size() - sizeof(trailer), sizeof(trailer));
+        uint64_t footerEnd = data.size() - sizeof(trailer);
+        if (memcmp(trailer.magic, columnar::kMagic, sizeof(trailer.magic)) != 0 ||
+            trailer.footerOffset > footerEnd ||
+            (footerEnd - trailer.footerOffset) != uint64_t(trailer.columnCount) * sizeof(columnar::FooterEntry)) {
+            fail("damaged footer");
+        }
+        if (trailer.rows > data.size()) fail("damaged footer");
+        rows = static_cast<size_t>(trailer.rows);
+
+        const char* base = data.data();
+        auto column = [&](const string& name, columnar::ColumnType type, uint64_t expectedLength,
+                          uint64_t* length = nullptr) -> const char* {
+            for (uint32_t i = 0; i < trailer.columnCount; i++) {
+                columnar::FooterEntry entry;
+                memcpy(&entry, base + trailer.footerOffset + i * sizeof(entry), sizeof(entry));
+                entry.name[sizeof(entry.name) - 1] = '\0';
+                if (name != entry.name) continue;
+                if (entry.type != type || entry.offset % 8 != 0 || entry.offset > trailer.footerOffset ||
+                    entry.length > trailer.footerOffset - entry.offset ||
+                    (expectedLength != UINT64_MAX && entry.length != expectedLength)) {
+                    fail("bad column " + name);
+                }
+                if (length) *length = entry.length;
+                return base + entry.offset;
+            }
+            fail("missing column " + name);
+            return nullptr;
+        };
+
+        for (size_t i = 0; i < 4; i++) {
+            string prefix = columnar::kTextColumns[i];
+            text[i].offsets = reinterpret_cast<const uint64_t*>(column(prefix + ".offsets", columnar::Offsets, (rows + 1) * 8));
+            text[i].bytes = column(prefix + ".bytes", columnar::Bytes, UINT64_MAX, &text[i].length);
+        }
+        priceMinor = reinterpret_cast<const int64_t*>(column("price.minor", columnar::Int64, rows * 8));
+        currency = reinterpret_cast<const uint8_t*>(column("price.currency", columnar::UInt8, rows));
+        ratings = reinterpret_cast<const int32_t*>(column("rating.hundredths", columnar::Int32, rows * 4));
+    }
+};
+
+// Fans every product out to several sinks
+class MultiSink : public ProductSink {
+public:
+    void add(unique_ptr<ProductSink> sink) { sinks.push_back(move(sink)); }
+    bool empty() const { return sinks.empty(); }
+
+    void write(const ProductView& product) override {
+        StageTimer timer(Metrics::Serialize);
+        for (auto& sink : sinks) sink->write(product);
+        written++;
+    }
+
+    void finish() override {
+        StageTimer timer(Metrics::Serialize);
+        for (auto& sink : sinks) sink->finish();
+    }
+
+    size_t count() const override { return written; }
+
+    string description() const override {
+        string names;
+        for (const auto& sink : sinks) names += (names.empty() ? "" : ", ") + sink->description();
+        return names;
+    }
+
+private:
+    vector<unique_ptr<ProductSink>> sinks;
+    size_t written = 0;
+};
+
+// Output formats, combinable as flags
+enum OutputFormat : unsigned {
+    FormatCSV = 1,
+    FormatJSON = 2,
+    FormatNDJSON = 4,
+    FormatColumnar = 8
+};
+
+// Parse "csv,json,ndjson,pcol" into OutputFormat flags
+inline unsigned parseOutputFormats(const string& list) {
+    unsigned formats = 0;
+    istringstream names(list);
+    string name;
+    while (getline(names, name, ',')) {
+        if (equalsIgnoreCase(name, "csv")) formats |= FormatCSV;
+        else if (equalsIgnoreCase(name, "json")) formats |= FormatJSON;
+        else if (equalsIgnoreCase(name, "ndjson")) formats |= FormatNDJSON;
+        else if (equalsIgnoreCase(name, "pcol") || equalsIgnoreCase(name, "columnar")) formats |= FormatColumnar;
+        else if (!name.empty()) throw runtime_error("Unknown output format '" + name + "'");
+    }
+    return formats;
+}
+
+// products.csv -> products.json / products.ndjson
+inline string outputFileWithExtension(const string& outputFile, const string& extension) {
+    size_t dotPos = outputFile.find_last_of('.');
+    size_t slashPos = outputFile.find_last_of("/\\");
+    if (dotPos != string::npos && (slashPos == string::npos || dotPos > slashPos)) {
+        return outputFile.substr(0, dotPos) + extension;
+    }
+    return outputFile + extension;
+}
+
+// Sinks for the requested formats, named after outputFile
+inline unique_ptr<MultiSink> openSinks(const string& outputFile, unsigned formats) {
+    unique_ptr<MultiSink> sinks(new MultiSink());
+    if (formats & FormatCSV) sinks->add(unique_ptr<ProductSink>(new CsvSink(outputFileWithExtension(outputFile, ".csv"))));
+    if (formats & FormatJSON) sinks->add(unique_ptr<ProductSink>(new JsonSink(outputFileWithExtension(outputFile, ".json"))));
+    if (formats & FormatNDJSON) sinks->add(unique_ptr<ProductSink>(new NdjsonSink(outputFileWithExtension(outputFile, ".ndjson"))));
+    if (formats & FormatColumnar) sinks->add(unique_ptr<ProductSink>(new ColumnarSink(outputFileWithExtension(outputFile, ".pcol"))));
+    return sinks;
+}
+
+// ---------------------------------------------------------------------------
+// Product queries
+//
+// Filters, sorts and truncates products between extraction and output,
+// working on the parsed price and rating rather than their text:
+//
+//   --where "price>=10,price<250,rating>=4,name~headphones,currency=USD"
+//   --sort  "-rating,price"        a leading '-' sorts descending
+//   --top   100
+//
+// QuerySink runs a query in front of any other sink. Filtering alone passes
+// products straight through. A sort with --top keeps the best K in a
+// bounded heap, so memory stays O(K) however many products stream past; a
+// sort without a limit collects every product and sorts them in parallel
+// when the sink is finished. Ties keep extraction order.
+// ---------------------------------------------------------------------------
+
+// Stable sort on up to `threads` threads: chunks are sorted concurrently,
+// then merged pairwise
+template <typename T, typename Less>
+void parallelStableSort(vector<T>& items, Less less, unsigned threads) {
+    const size_t minChunk = 1u << 15;
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    size_t chunks = min<size_t>(threads, items.size() / minChunk);
+    if (chunks < 2) {
+        stable_sort(items.begin(), items.end(), less);
+        return;
+    }
+
+    vector<size_t> bounds(chunks + 1);
+    for (size_t i = 0; i <= chunks; i++) bounds[i] = items.size() * i / chunks;
+    ThreadPool pool(static_cast<unsigned>(chunks));
+    for (size_t i = 0; i < chunks; i++) {
+        pool.submit([&, i] { stable_sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], less); });
+    }
+    pool.wait();
+    for (size_t width = 1; width < chunks; width *= 2) {
+        for (size_t i = 0; i + width < chunks; i += 2 * width) {
+            size_t first = bounds[i], middle = bounds[i + width], last = bounds[min(i + 2 * width, chunks)];
+            pool.submit([&, first, middle, last] {
+                inplace_merge(items.begin() + first, items.begin() + middle, items.begin() + last, less);
+            });
+        }
+        pool.wait();
+    }
+}
+
+class ProductQuery {
+public:
+    enum Field { Price, Rating, Name, CurrencyCode };
+
+    struct SortKey {
+        Field field;
+        bool descending;
+    };
+
+    // Products passed on after sorting; 0 keeps all of them
+    size_t limit = 0;
+
+    // Build a query from the --where / --sort / --top texts. Throws
+    // invalid_argument naming the term it cannot read.
+    static ProductQuery parse(const string& where, const string& sort, size_t limit) {
+        ProductQuery query;
+        query.limit = limit;
+        for (const string& term : splitList(where)) query.conditions.push_back(parseCondition(term));
+        for (string term : splitList(sort)) {
+            bool descending = term[0] == '-';
+            if (term[0] == '-' || term[0] == '+') term.erase(0, 1);
+            Field field = parseField(term);
+            if (field == CurrencyCode) throw invalid_argument("Cannot sort by " + term);
+            query.keys.push_back(SortKey{field, descending});
+        }
+        return query;
+    }
+
+    bool empty() const { return conditions.empty() && keys.empty() && limit == 0; }
+    bool sorted() const { return !keys.empty(); }
+
+    bool matches(const ProductView& product) const {
+        for (const auto& condition : conditions) {
+            if (!condition.matches(product)) return false;
+        }
+        return true;
+    }
+
+    // Strict weak order over the sort keys: true when a goes first.
+    // Products without a parsed price go last in either direction.
+    bool ranksBefore(const ProductView& a, const ProductView& b) const {
+        for (const auto& key : keys) {
+            int order = 0;
+            switch (key.field) {
+                case Price:
+                    if (a.amount.valid != b.amount.valid) return a.amount.valid;
+                    order = a.amount.minorUnits < b.amount.minorUnits ? -1 : a.amount.minorUnits > b.amount.minorUnits;
+                    break;
+                case Rating:
+                    order = a.ratingHundredths < b.ratingHundredths ? -1 : a.ratingHundredths > b.ratingHundredths;
+                    break;
+                case Name:
+                    order = a.name.compare(b.name);
+                    break;
+                case CurrencyCode:
+                    break;
+            }
+            if (order != 0) return key.descending ? order > 0 : order < 0;
+        }
+        return false;
+    }
+
+private:
+    struct Condition {
+        enum Op { Less, LessEqual, Equal, GreaterEqual, Greater, Contains };
+
+        Field field;
+        Op op;
+        int64_t number = 0;    // minor units or rating hundredths
+        string text;           // name substring
+        Currency currency = Currency::Unknown;
+
+        bool matches(const ProductView& product) const {
+            if (field == Name) return findIgnoreCase(product.name, text) != string_view::npos;
+            if (field == CurrencyCode) return product.amount.valid && product.amount.currency == currency;
+            if (field == Price && !product.amount.valid) return false;
+            int64_t value = field == Price ? product.amount.minorUnits : product.ratingHundredths;
+            switch (op) {
+                case Less: return value < number;
+                case LessEqual: return value <= number;
+                case Equal: return value == number;
+                case GreaterEqual: return value >= number;
+                case Greater: return value > number;
+                case Contains: return false;
+            }
+            return false;
+        }
+    };
+
+    vector<Condition> conditions;
+    vector<SortKey> keys;
+
+    static vector<string> splitList(const string& text) {
+        vector<string> terms;
+        istringstream list(text);
+        string term;
+        while (getline(list, term, ',')) {
+            size_t begin = term.find_first_not_of(" \t");
+            if (begin == string::npos) continue;
+            terms.push_back(term.substr(begin, term.find_last_not_of(" \t") - begin + 1));
+        }
+        return terms;
+    }
+
+    static Field parseField(const string& name) {
+        if (equalsIgnoreCase(name, "price")) return Price;
+        if (equalsIgnoreCase(name, "rating")) return Rating;
+        if (equalsIgnoreCase(name, "name")) return Name;
+        if (equalsIgnoreCase(name, "currency")) return CurrencyCode;
+        throw invalid_argument("Unknown product field: " + name);
+    }
+
+    // "price>=10", "rating<4.5", "name~phone", "currency=EUR"
+    static Condition parseCondition(const string& term) {
+        static const pair<const char*, Condition::Op> operators[] = {
+            {">=", Condition::GreaterEqual}, {"<=", Condition::LessEqual}, {">", Condition::Greater},
+            {"<", Condition::Less}, {"=", Condition::Equal}, {"~", Condition::Contains}
+        };
+        size_t at = term.find_first_of("<>=~");
+        if (at == string::npos || at == 0) throw invalid_argument("Bad query condition: " + term);
+        Condition condition{};
+        condition.field = parseField(term.substr(0, at));
+        size_t valueStart = at;
+        for (const auto& op : operators) {
+            if (term.compare(at, strlen(op.first), op.first) == 0) {
+                condition.op = op.second;
+                valueStart = at + strlen(op.first);
+                break;
+            }
+        }
+        string value = term.substr(valueStart);
+
+        bool valid = condition.field == Name ? condition.op == Condition::Contains
+                   : condition.field == CurrencyCode ? condition.op == Condition::Equal
+                   : condition.op != Condition::Contains;
+        if (!valid) throw invalid_argument("Bad query condition: " + term);
+        if (condition.field == Name) {
+            condition.text = value;
+        } else if (condition.field == CurrencyCode) {
+            condition.currency = detectCurrency(value);
+            if (condition.currency == Currency::Unknown) throw invalid_argument("Unknown currency in: " + term);
+        } else {
+            Money amount = parsePrice(value);
+            if (!amount.valid || value.find_first_not_of("0123456789.") != string::npos) {
+                throw invalid_argument("Bad number in query condition: " + term);
+            }
+            condition.number = amount.minorUnits;
+        }
+        return condition;
+    }
+};
+
+// Runs a ProductQuery in front of another sink (usually a MultiSink)
+class QuerySink : public ProductSink {
+public:
+    QuerySink(shared_ptr<const ProductQuery> productQuery, unique_ptr<ProductSink> downstream, unsigned threads = 0)
+        : query(move(productQuery)), next(move(downstream)), sortThreads(threads) {
+        if (query->sorted() && query->limit > 0) heap.reserve(query->limit);
+    }
+
+    void write(const ProductView& product) override {
+        if (!query->matches(product)) return;
+        if (!query->sorted()) {
+            if (query->limit == 0 || passed < query->limit) next->write(product);
+            passed++;
+        } else if (query->limit == 0) {
+            kept.add(product);
+        } else {
+            offer(product);
+        }
+    }
+
+    void finish() override {
+        if (query->sorted() && query->limit == 0) {
+            parallelStableSort(kept.products, [this](const ProductView& a, const ProductView& b) {
+                return query->ranksBefore(a, b);
+            }, sortThreads);
+            for (const auto& product : kept.products) next->write(product);
+            kept.clear();
+        } else if (query->sorted()) {
+            sort_heap(heap.begin(), heap.end(), [this](const Ranked& a, const Ranked& b) { return before(a, b); });
+            for (const auto& entry : heap) next->write(entry.view());
+            heap.clear();
+        }
+        next->finish();
+    }
+
+    size_t count() const override { return next->count(); }
+    string description() const override { return next->description(); }
+
+private:
+    // A top-K candidate; owns its text because the product it came from
+    // may be gone by the time the heap is written out
+    struct Ranked {
+        Product product;
+        Money amount;
+        int32_t ratingHundredths = 0;
+        uint64_t sequence = 0;
+
+        ProductView view() const {
+            ProductView view;
+            view.name = product.name;
+            view.price = product.price;
+            view.rating = product.rating;
+            view.url = product.url;
+            view.amount = amount;
+            view.ratingHundredths = ratingHundredths;
+            return view;
+        }
+
+        void assign(const ProductView& from, uint64_t order) {
+            product.name.assign(from.name.data(), from.name.size());
+            product.price.assign(from.price.data(), from.price.size());
+            product.rating.assign(from.rating.data(), from.rating.size());
+            product.url.assign(from.url.data(), from.url.size());
+            amount = from.amount;
+            ratingHundredths = from.ratingHundredths;
+            sequence = order;
+        }
+    };
+
+    shared_ptr<const ProductQuery> query;
+    unique_ptr<ProductSink> next;
+    unsigned sortThreads;
+    size_t passed = 0;
+    uint64_t sequence = 0;
+    ProductBatch kept;        // sort without a limit
+    vector<Ranked> heap;      // top-K: max-heap on rank, worst kept product on top
+
+    bool before(const Ranked& a, const Ranked& b) const {
+        ProductView left = a.view(), right = b.view();
+        if (query->ranksBefore(left, right)) return true;
+        if (query->ranksBefore(right, left)) return false;
+        return a.sequence < b.sequence;
+    }
+
+    void offer(const ProductView& product) {
+        auto worse = [this](const Ranked& a, const Ranked& b) { return before(a, b); };
+        uint64_t order = sequence++;
+        if (heap.size() < query->limit) {
+            heap.emplace_back();
+            heap.back().assign(product, order);
+            push_heap(heap.begin(), heap.end(), worse);
+            return;
+        }
+        // Equal rank loses to the earlier product already kept
+        if (!query->ranksBefore(product, heap.front().view())) return;
+        pop_heap(heap.begin(), heap.end(), worse);
+        heap.back().assign(product, order);
+        push_heap(heap.begin(), heap.end(), worse);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Extraction cache
+//
+// Maps a page (XXH64 of its bytes) and a rule set (XXH64 of its source
+// text) to the products extracted from it, kept as .pcol files in one
+// directory. Unchanged pages skip extraction entirely. A hit marks the
+// entry as recently used (also on disk, through its modification time);
+// once the directory outgrows its size limit the least recently used
+// entries are deleted. Entries are written to a temporary file and renamed
+// into place, so several runs can share a directory.
+// ---------------------------------------------------------------------------
+
+// XXH64 (https://github.com/Cyan4973/xxHash), reading input as little-endian
+inline uint64_t xxhash64(string_view data, uint64_t seed = 0) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t prime3 = 0x165667B19E3779F9ull;
+    const uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+    auto rotl = [](uint64_t x, int bits) { return (x << bits) | (x >> (64 - bits)); };
+    auto read64 = [](const char* p) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    };
+    auto read32 = [](const char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * prime2, 31) * prime1; };
+    auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * prime1 + prime4; };
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t h;
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        for (; end - p >= 32; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+    h += data.size();
+
+    for (; end - p >= 8; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+    if (end - p >= 4) {
+        h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ (static_cast<unsigned char>(*p) * prime5), 11) * prime1;
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+class ExtractionCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t stores = 0;
+        size_t evictions = 0;
+    };
+
+    // Open (creating it if needed) a cache directory limited to maxBytes
+    ExtractionCache(const string& cacheDirectory, uint64_t maxBytes)
+        : directory(cacheDirectory), limit(maxBytes) {
+        namespace fs = std::filesystem;
+        fs::create_directories(directory);
+
+        // Rebuild the LRU order from modification times
+        vector<pair<fs::file_time_type, Entry>> found;
+        for (const auto& file : fs::directory_iterator(directory)) {
+            if (!file.is_regular_file() || file.path().extension() != ".pcol") continue;
+            error_code error;
+            auto modified = fs::last_write_time(file.path(), error);
+            if (error) continue;
+            found.push_back({modified, Entry{file.path().stem().string(), file.file_size()}});
+        }
+        sort(found.begin(), found.end(), [](const pair<fs::file_time_type, Entry>& a, const pair<fs::file_time_type, Entry>& b) {
+            return a.first > b.first;
+        });
+        for (auto& entry : found) {
+            totalBytes += entry.second.bytes;
+            recent.push_back(move(entry.second));
+            index[recent.back().key] = prev(recent.end());
+        }
+        evictOverLimit();
+    }
+
+    // Cache key for a page under a rule set; context names any other
+    // setting that changes the products (URL normalization, say)
+    static string key(string_view page, const ExtractionRules& rules, string_view context = string_view()) {
+        static const char hex[] = "0123456789abcdef";
+        uint64_t settings = xxhash64(rules.source(), kFormatVersion);
+        if (!context.empty()) settings = xxhash64(context, settings);
+        uint64_t parts[2] = {xxhash64(page), settings};
+        string text;
+        for (uint64_t part : parts) {
+            if (!text.empty()) text += '-';
+            for (int shift = 60; shift >= 0; shift -= 4) text += hex[(part >> shift) & 0xF];
+        }
+        return text;
+    }
+
+    // Products cached under key, or null on a miss
+    shared_ptr<const ProductColumns> lookup(const string& key) {
+        {
+            lock_guard<mutex> guard(lock);
+            auto found = index.find(key);
+            if (found == index.end()) {
+                counts.misses++;
+                return nullptr;
+            }
+            recent.splice(recent.begin(), recent, found->second);
+        }
+
+        string path = pathFor(key);
+        try {
+            shared_ptr<const ProductColumns> columns = ProductColumns::open(path);
+            error_code ignored;
+            filesystem::last_write_time(path, filesystem::file_time_type::clock::now(), ignored);
+            lock_guard<mutex> guard(lock);
+            counts.hits++;
+            return columns;
+        } catch (const exception&) {
+            // Deleted or damaged behind our back: forget it
+            lock_guard<mutex> guard(lock);
+            forget(key);
+            counts.misses++;
+            return nullptr;
+        }
+    }
+
+    // Cache products[first..] under key; throws runtime_error when the
+    // entry cannot be written
+    void store(const string& key, const vector<ProductView>& products, size_t first = 0) {
+        string path = pathFor(key);
+        {
+            ColumnarSink sink(path);
+            for (size_t i = first; i < products.size(); i++) sink.write(products[i]);
+            sink.finish();
+        }
+        uint64_t bytes = filesystem::file_size(path);
+
+        lock_guard<mutex> guard(lock);
+        forget(key);
+        recent.push_front(Entry{key, bytes});
+        index[key] = recent.begin();
+        totalBytes += bytes;
+        counts.stores++;
+        evictOverLimit();
+    }
+
+    Stats stats() const {
+        lock_guard<mutex> guard(lock);
+        return counts;
+    }
+
+    // "12 hits, 3 misses (80.0% hit rate), 3 stored, 0 evicted; 15 entries, 1.2 MB"
+    string summary() const {
+        lock_guard<mutex> guard(lock);
+        size_t lookups = counts.hits + counts.misses;
+        ostringstream text;
+        text << counts.hits << " hits, " << counts.misses << " misses (" << fixed << setprecision(1)
+             << (lookups ? 100.0 * counts.hits / lookups : 0.0) << "% hit rate), " << counts.stores
+             << " stored, " << counts.evictions << " evicted; " << recent.size() << " entries, "
+             << totalBytes / 1048576.0 << " MB";
+        return text.str();
+    }
+
+private:
+    // Part of every rules hash; bump when extraction output changes for the same rules
+    static constexpr uint64_t kFormatVersion = 1;
+
+    struct Entry {
+        string key;
+        uint64_t bytes;
+    };
+
+    string directory;
+    uint64_t limit;
+    mutable mutex lock;
+    list<Entry> recent;   // most recently used first
+    unordered_map<string, list<Entry>::iterator> index;
+    uint64_t totalBytes = 0;
+    Stats counts;
+
+    string pathFor(const string& key) const {
+        return (filesystem::path(directory) / (key + ".pcol")).string();
+    }
+
+    // Delete least recently used entries until the cache fits its limit,
+    // keeping the newest even if it alone is over; call with lock held
+    void evictOverLimit() {
+        while (totalBytes > limit && recent.size() > 1) {
+            Entry& oldest = recent.back();
+            error_code ignored;
+            filesystem::remove(pathFor(oldest.key), ignored);
+            counts.evictions++;
+            forget(oldest.key);
+        }
+    }
+
+    void forget(const string& key) {
+        auto found = index.find(key);
+        if (found == index.end()) return;
+        totalBytes -= found->second->bytes;
+        recent.erase(found->second);
+        index.erase(found);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Page record streams
+//
+// A fetcher can pipe pages straight into the scraper instead of saving them
+// as files. Two framings are read:
+//
+//   NDJSON           one object per line: {"url": "...", "html": "..."}
+//                    (other members are ignored)
+//   length-prefixed  a header line "<byte count>[ <url>]" followed by
+//                    exactly that many bytes of HTML
+//
+// The reader, the extractor and the writer each run on their own thread,
+// handing pages on through bounded lock-free single-producer queues, so
+// reading the next page overlaps extracting this one.
+// ---------------------------------------------------------------------------
+
+// Bounded single-producer / single-consumer ring. tryPush() and tryPop()
+// never block or lock; push() and pop() wait with a spin / yield / sleep
+// backoff until they succeed or `stop` is set.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer only; value is moved from only on success
+    bool tryPush(T& value) {
+        size_t tail = tailIndex.load(memory_order_relaxed);
+        if (tail - headCache == slots.size()) {
+            headCache = headIndex.load(memory_order_acquire);
+            if (tail - headCache == slots.size()) return false;
+        }
+        slots[tail & mask] = move(value);
+        tailIndex.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    bool tryPop(T& value) {
+        size_t head = headIndex.load(memory_order_relaxed);
+        if (head == tailCache) {
+            tailCache = tailIndex.load(memory_order_acquire);
+            if (head == tailCache) return false;
+        }
+        value = move(slots[head & mask]);
+        headIndex.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    bool push(T value, const atomic<bool>& stop) {
+        for (unsigned attempt = 0; !tryPush(value); attempt++) {
+            if (stop.load(memory_order_relaxed)) return false;
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    bool pop(T& value, const atomic<bool>& stop) {
+        for (unsigned attempt = 0; !tryPop(value); attempt++) {
+            if (stop.load(memory_order_relaxed)) return false;
+            backoff(attempt);
+        }
+        return true;
+    }
+
+private:
+    vector<T> slots;
+    size_t mask = 0;
+    // Each index sits on its own cache line with the copy of the other
+    // index that only its owner reads
+    alignas(64) atomic<size_t> headIndex{0};
+    size_t tailCache = 0;
+    alignas(64) atomic<size_t> tailIndex{0};
+    size_t headCache = 0;
+
+    static void backoff(unsigned attempt) {
+        if (attempt < 64) return;
+        if (attempt < 128) this_thread::yield();
+        else this_thread::sleep_for(chrono::microseconds(50));
+    }
+};
+
+struct PageRecord {
+    string url;
+    string html;
+};
+
+class PageRecordReader {
+public:
+    enum Format { Auto, Ndjson, LengthPrefixed };
+
+    // Largest page accepted from a length prefix
+    static constexpr size_t kMaxRecordBytes = size_t(1) << 30;
+
+    explicit PageRecordReader(FILE* input, Format format = Auto) : in(input), format(format), buffer(1u << 20) {}
+
+    // "ndjson", "length" or "auto"; throws invalid_argument otherwise
+    static Format parseFormat(const string& name) {
+        if (equalsIgnoreCase(name, "auto")) return Auto;
+        if (equalsIgnoreCase(name, "ndjson") || equalsIgnoreCase(name, "json")) return Ndjson;
+        if (equalsIgnoreCase(name, "length") || equalsIgnoreCase(name, "length-prefixed")) return LengthPrefixed;
+        throw invalid_argument("Unknown page format: " + name);
+    }
+
+    // Read the next page; false at the end of the input. NDJSON lines that
+    // are not page objects are skipped and counted. Throws runtime_error
+    // when a length-prefixed stream loses its framing or the read fails.
+    bool next(PageRecord& record) {
+        string& line = lineBuffer;
+        while (readLine(line)) {
+            lineNumber++;
+            if (isBlank(line)) continue;
+            if (format == Auto) format = line[line.find_first_not_of(" \t\r")] == '{' ? Ndjson : LengthPrefixed;
+
+            if (format == Ndjson) {
+                if (parseRecord(line, record)) return true;
+                malformed++;
+                continue;
+            }
+
+            // Header: decimal byte count, then an optional URL
+            size_t i = line.find_first_not_of(" \t");
+            size_t length = 0;
+            size_t digits = 0;
+            for (; i < line.size() && line[i] >= '0' && line[i] <= '9'; i++, digits++) {
+                length = length * 10 + static_cast<size_t>(line[i] - '0');
+                if (length > kMaxRecordBytes) break;
+            }
+            if (digits == 0 || length > kMaxRecordBytes || (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r')) {
+                throw runtime_error("Bad length prefix on line " + to_string(lineNumber) + " of the page stream");
+            }
+            size_t urlStart = line.find_first_not_of(" \t", i);
+            size_t urlEnd = line.find_last_not_of(" \t\r");
+            record.url = urlStart == string::npos || urlEnd < urlStart ? string() : line.substr(urlStart, urlEnd - urlStart + 1);
+            readExact(length, record.html);
+            return true;
+        }
+        return false;
+    }
+
+    size_t malformedRecords() const { return malformed; }
+
+private:
+    FILE* in;
+    Format format;
+    vector<char> buffer;
+    size_t position = 0;
+    size_t available = 0;
+    size_t lineNumber = 0;
+    size_t malformed = 0;
+    string lineBuffer;
+
+    // Take whatever input is ready: fread() would wait for a full buffer,
+    // holding back pages that have already arrived on a pipe
+    bool fill() {
+        position = 0;
+#ifdef SCRAPER_HAVE_MMAP
+        ssize_t got;
+        do {
+            got = ::read(fileno(in), buffer.data(), buffer.size());
+        } while (got < 0 && errno == EINTR);
+        if (got < 0) throw runtime_error("Could not read the page stream");
+        available = static_cast<size_t>(got);
+#else
+        available = fread(buffer.data(), 1, buffer.size(), in);
+        if (available == 0 && ferror(in)) throw runtime_error("Could not read the page stream");
+#endif
+        return available > 0;
+    }
+
+    // Next line without its '\n'; false at the end of the input
+    bool readLine(string& line) {
+        line.clear();
+        bool any = false;
+        while (position < available || fill()) {
+            any = true;
+            const char* start = buffer.data() + position;
+            const char* newline = static_cast<const char*>(memchr(start, '\n', available - position));
+            if (newline) {
+                line.append(start, newline);
+                position += static_cast<size_t>(newline - start) + 1;
+                return true;
+            }
+            line.append(start, available - position);
+            position = available;
+        }
+        return any;
+    }
+
+    void readExact(size_t count, string& out) {
+        out.clear();
+        out.reserve(count);
+        while (out.size() < count) {
+            if (position == available && !fill()) {
+                throw runtime_error("Page stream ended inside a " + to_string(count) + "-byte record");
+            }
+            size_t take = min(count - out.size(), available - position);
+            out.append(buffer.data() + position, take);
+            position += take;
+        }
+    }
+
+    static bool isBlank(const string& line) {
+        return line.find_first_not_of(" \t\r") == string::npos;
+    }
+
+    static void skipSpace(string_view text, size_t& i) {
+        while (i < text.size() && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n')) i++;
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static bool parseHex4(string_view text, size_t i, uint32_t& value) {
+        if (i + 4 > text.size()) return false;
+        value = 0;
+        for (size_t k = i; k < i + 4; k++) {
+            int digit = hexValue(text[k]);
+            if (digit < 0) return false;
+            value = value * 16 + static_cast<uint32_t>(digit);
+        }
+        return true;
+    }
+
+    // JSON string starting at text[i] == '"'; leaves i after the closing quote
+    static bool parseString(string_view text, size_t& i, string* out) {
+        if (i >= text.size() || text[i] != '"') return false;
+        i++;
+        while (i < text.size()) {
+            size_t run = i;
+            while (i < text.size() && text[i] != '"' && text[i] != '\\') i++;
+            if (out) out->append(text.data() + run, i - run);
+            if (i >= text.size()) return false;
+            if (text[i] == '"') {
+                i++;
+                return true;
+            }
+            if (++i >= text.size()) return false;
+            char escape = text[i++];
+            char plain = 0;
+            switch (escape) {
+                case '"': plain = '"'; break;
+                case '\\': plain = '\\'; break;
+                case '/': plain = '/'; break;
+                case 'b': plain = '\b'; break;
+                case 'f': plain = '\f'; break;
+                case 'n': plain = '\n'; break;
+                case 'r': plain = '\r'; break;
+                case 't': plain = '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!parseHex4(text, i, cp)) return false;
+                    i += 4;
+                    uint32_t low;
+                    if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 <= text.size() && text[i] == '\\' &&
+                        text[i + 1] == 'u' && parseHex4(text, i + 2, low) && low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                    if (out) appendUtf8(cp, *out);
+                    continue;
+                }
+                default: return false;
+            }
+            if (out) *out += plain;
+        }
+        return false;
+    }
+
+    // Skip any JSON value (nesting is tracked, contents are not checked)
+    static bool skipValue(string_view text, size_t& i) {
+        skipSpace(text, i);
+        if (i >= text.size()) return false;
+        if (text[i] == '"') return parseString(text, i, nullptr);
+        if (text[i] != '{' && text[i] != '[') {
+            while (i < text.size() && text[i] != ',' && text[i] != '}' && text[i] != ']') i++;
+            return true;
+        }
+        size_t depth = 0;
+        while (i < text.size()) {
+            char c = text[i];
+            if (c == '"') {
+                if (!parseString(text, i, nullptr)) return false;
+                continue;
+            }
+            if (c == '{' || c == '[') depth++;
+            if ((c == '}' || c == ']') && --depth == 0) {
+                i++;
+                return true;
+            }
+            i++;
+        }
+        return false;
+    }
+
+    // {"url": "...", "html": "..."}; html is required
+    static bool parseRecord(string_view line, PageRecord& record) {
+        record.url.clear();
+        record.html.clear();
+        bool hasHtml = false;
+        size_t i = 0;
+        skipSpace(line, i);
+        if (i >= line.size() || line[i++] != '{') return false;
+        skipSpace(line, i);
+        if (i < line.size() && line[i] == '}') return false;
+        string key;
+        while (i < line.size()) {
+            skipSpace(line, i);
+            key.clear();
+            if (!parseString(line, i, &key)) return false;
+            skipSpace(line, i);
+            if (i >= line.size() || line[i++] != ':') return false;
+            skipSpace(line, i);
+            bool isString = i < line.size() && line[i] == '"';
+            if (key == "html" && isString) {
+                if (!parseString(line, i, &record.html)) return false;
+                hasHtml = true;
+            } else if (key == "url" && isString) {
+                if (!parseString(line, i, &record.url)) return false;
+            } else if (!skipValue(line, i)) {
+                return false;
+            }
+            skipSpace(line, i);
+            if (i >= line.size()) return false;
+            if (line[i] == '}') return hasHtml;
+            if (line[i++] != ',') return false;
+        }
+        return false;
+    }
 };
 
-class EcommerceScraper {
+// ---------------------------------------------------------------------------
+// Synthetic catalogs and benchmarking
+//
+// CatalogGenerator writes catalog pages of any size that use every
+// container layout the built-in rules recognize, mixed with the markup a
+// real listing page carries (navigation, scripts, styles, comments, ads).
+// Each product is derived from (seed, index) alone, so a page is
+// reproducible and any range of it can be regenerated on its own.
+// SampleGenerator does the same for product records written straight to
+// the output sinks, for loading downstream systems.
+//
+// Heap allocations are counted by the operator new replacement at the top
+// of the file, in builds with -DSCRAPER_COUNT_ALLOCATIONS.
+// ---------------------------------------------------------------------------
+
+// Peak resident set size of the process in bytes, 0 when unknown
+inline size_t peakResidentBytes() {
+#ifdef SCRAPER_HAVE_MMAP
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Words generated product names are made of
+namespace catalogwords {
+
+const char* const brands[] = {
+    "Acme", "Northwind", "Contoso", "Globex", "Initech", "Umbrella", "Hooli", "Vandelay",
+    "Soylent", "Stark", "Wayne", "Tyrell", "Cyberdyne", "Wonka", "Aperture", "Oscorp"
+};
+const char* const lines[] = {
+    "Wireless Headphones", "Smart TV", "Laptop", "Mechanical Keyboard", "Espresso Machine",
+    "Running Shoes", "Backpack", "Smartphone", "Fitness Tracker", "Air Purifier",
+    "Gaming Mouse", "Bluetooth Speaker", "Digital Camera", "Office Chair", "Blender"
+};
+const char* const variants[] = {
+    "Black", "Silver", "128GB", "Pro", "Max", "Mini", "2nd Gen", "XL", "Slim", "Ultra"
+};
+
+} // namespace catalogwords
+
+class CatalogGenerator {
+public:
+    explicit CatalogGenerator(uint64_t seed = 42) : seed(seed) {}
+
+    // Write a page with `count` products, handing it to emit in chunks of
+    // about chunkSize bytes
+    void generate(size_t count, const function<void(string_view)>& emit, size_t chunkSize = 1u << 16) const {
+        string page;
+        page.reserve(chunkSize + 4096);
+        appendHeader(count, page);
+        for (size_t i = 0; i < count; i++) {
+            if (i % kPageSize == 0) appendSectionBreak(i, count, page);
+            appendProduct(i, page);
+            if (page.size() >= chunkSize) {
+                emit(page);
+                page.clear();
+            }
+        }
+        appendFooter(page);
+        emit(page);
+    }
+
+    string generate(size_t count) const {
+        string page;
+        generate(count, [&](string_view chunk) { page.append(chunk.data(), chunk.size()); });
+        return page;
+    }
+
+    // Returns the number of bytes written
+    size_t writeToFile(const string& filename, size_t count) const {
+        BufferedFileWriter out(filename);
+        generate(count, [&](string_view chunk) { out.write(chunk); });
+        out.commit();
+        return out.bytesWritten();
+    }
+
+    // Number of distinct container layouts products rotate through
+    static constexpr size_t kLayouts = 6;
+
 private:
-    vector<string> sampleNames = {
-        "iPhone 14 Pro Max 128GB Space Black",
-        "Samsung Galaxy S23 Ultra 256GB Phantom Black",
-        "MacBook Air M2 13-inch Silver",
-        "Sony WH-1000XM4 Wireless Headphones",
-        "Dell XPS 13 Laptop Intel i7 16GB RAM",
-        "iPad Air 5th Generation 64GB WiFi",
-        "Nintendo Switch OLED White",
-        "Apple AirPods Pro 2nd Generation",
-        "Amazon Kindle Paperwhite 11th Gen",
-        "Echo Dot 5th Gen with Alexa",
-        "Samsung 55-inch 4K Smart TV",
-        "HP LaserJet Pro Printer",
-        "Logitech MX Master 3S Wireless Mouse",
-        "JBL Flip 6 Bluetooth Speaker",
-        "Canon EOS R6 Mark II Camera Body",
-        "Microsoft Surface Pro 9 Tablet",
-        "Google Nest Hub Max Smart Display",
-        "Fitbit Charge 5 Fitness Tracker",
-        "Bose QuietComfort 45 Headphones",
-        "LG UltraWide 34-inch Monitor"
+    static constexpr size_t kPageSize = 48;
+
+    uint64_t seed;
+
+    // splitmix64 stream for one product
+    struct Random {
+        uint64_t state;
+
+        uint64_t next() {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        size_t below(size_t bound) { return static_cast<size_t>(next() % bound); }
+
+        template <size_t N>
+        const char* pick(const char* const (&choices)[N]) { return choices[below(N)]; }
     };
-    
-    vector<string> samplePrices = {
-        "$1099.00", "$1199.99", "$1199.00", "$349.99", "$999.99",
-        "$599.00", "$349.99", "$249.00", "$139.99", "$49.99",
-        "$799.99", "$229.99", "$99.99", "$129.99", "$2499.00",
-        "$1099.99", "$229.99", "$149.95", "$329.00", "$499.99"
+
+    Random randomFor(size_t index) const {
+        Random random{seed ^ (static_cast<uint64_t>(index) * 0xD1B54A32D192ED03ull)};
+        random.next();
+        return random;
+    }
+
+    // "1,234,567" or, for rupees, "12,34,567"
+    static void appendGrouped(uint64_t whole, bool indian, string& out) {
+        string digits = to_string(whole);
+        size_t n = digits.size();
+        for (size_t i = 0; i < n; i++) {
+            size_t left = n - i;
+            out += digits[i];
+            bool boundary = indian ? left > 3 && (left - 3) % 2 == 1 : left > 1 && (left - 1) % 3 == 0;
+            if (boundary) out += ',';
+        }
+    }
+
+    void appendName(Random& random, string& out) const {
+        using namespace catalogwords;
+
+        out += random.pick(brands);
+        out += ' ';
+        out += random.pick(lines);
+        out += ' ';
+        out += static_cast<char>('A' + random.below(26));
+        out += to_string(100 + random.below(900));
+        // Some names carry the markup and punctuation cleanText must handle
+        switch (random.below(8)) {
+            case 0: out += " &amp; Case"; break;
+            case 1: out += ", "; out += random.pick(variants); break;
+            case 2: out += " <b>"; out += random.pick(variants); out += "</b>"; break;
+            case 3: out += " &quot;"; out += random.pick(variants); out += "&quot;"; break;
+            default: out += ' '; out += random.pick(variants); break;
+        }
+    }
+
+    void appendUrl(size_t index, string& out) const {
+        out += "/product/item-";
+        out += to_string(index + 1);
+        out += "?ref=list";
+    }
+
+    void appendProduct(size_t index, string& out) const {
+        Random random = randomFor(index);
+        size_t layout = index % kLayouts;
+        uint64_t cents = 499 + random.below(300000);
+        unsigned ratingTenths = static_cast<unsigned>(10 + random.below(41));
+
+        auto price = [&](const char* symbol, bool grouped) {
+            out += symbol;
+            if (grouped) appendGrouped(cents / 100, false, out);
+            else out += to_string(cents / 100);
+            out += '.';
+            out += static_cast<char>('0' + cents % 100 / 10);
+            out += static_cast<char>('0' + cents % 10);
+        };
+        auto rating = [&] {
+            out += static_cast<char>('0' + ratingTenths / 10);
+            out += '.';
+            out += static_cast<char>('0' + ratingTenths % 10);
+        };
+
+        switch (layout) {
+            case 0:
+                out += "<div data-component-type=\"s-search-result\" data-asin=\"B0";
+                out += to_string(1000000 + index);
+                out += "\" class=\"s-result\">\n  <div class=\"s-card\">\n    <h2 class=\"a-size-mini s-title\"><a class=\"a-link-normal\" href=\"";
+                appendUrl(index, out);
+                out += "\"><span>";
+                appendName(random, out);
+                out += "</span></a></h2>\n    <span class=\"a-price\"><span class=\"a-offscreen\">";
+                price("$", true);
+                out += "</span></span>\n    <span class=\"a-icon-alt\">";
+                rating();
+                out += " out of 5 stars</span>\n  </div>\n</div>\n";
+                break;
+            case 1:
+                out += "<div class=\"product-item\">\n  <h2 class=\"product-title\">";
+                appendName(random, out);
+                out += "</h2>\n  <span class=\"price\">";
+                price("$", false);
+                out += "</span>\n  <span class=\"rating\">";
+                rating();
+                out += "</span>\n  <a href=\"";
+                appendUrl(index, out);
+                out += "\">View Product</a>\n</div>\n";
+                break;
+            case 2:
+                out += "<div class=\"product-card\">\n  <a class=\"card-link\" href=\"";
+                appendUrl(index, out);
+                out += "\"><img src=\"/img/p";
+                out += to_string(index + 1);
+                out += ".jpg\" alt=\"\"><h3 class=\"name\">";
+                appendName(random, out);
+                out += "</h3></a>\n  <div class=\"price-box\">";
+                price(random.below(2) ? "€" : "£", true);
+                out += "</div>\n  <div class=\"stars\">";
+                rating();
+                out += "</div>\n</div>\n";
+                break;
+            case 3:
+                out += "<article class=\"product\">\n  <header><a class=\"title\" href=\"";
+                appendUrl(index, out);
+                out += "\">";
+                appendName(random, out);
+                out += "</a></header>\n  <p>";
+                if (random.below(2)) {
+                    out += "USD ";
+                    appendGrouped(cents / 100, false, out);
+                } else {
+                    out += "INR ";
+                    appendGrouped(cents, true, out);
+                }
+                out += "</p>\n  <p>Rating: ";
+                rating();
+                out += "</p>\n</article>\n";
+                break;
+            case 4:
+                out += "<li class=\"product\">\n  <span class=\"title\">";
+                appendName(random, out);
+                out += "</span>\n  <span class=\"cost\">Cost: ";
+                out += to_string(cents / 100);
+                out += "</span>\n  <span>";
+                rating();
+                out += "/5</span>\n  <a href=\"";
+                appendUrl(index, out);
+                out += "\">Details</a>\n</li>\n";
+                break;
+            default:
+                out += "<div class=\"item\">\n  <div class=\"name\">";
+                appendName(random, out);
+                out += "</div>\n  <span class=\"price\">₹";
+                appendGrouped(cents, true, out);
+                out += "</span>\n  <span class=\"badge\">★ ";
+                rating();
+                out += "</span>\n  <a href=\"";
+                appendUrl(index, out);
+                out += "\">Buy</a>\n</div>\n";
+                break;
+        }
+    }
+
+    void appendHeader(size_t count, string& out) const {
+        out += "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Catalog - ";
+        out += to_string(count);
+        out += " products</title>\n<style>\n.product-item > h2 { font-weight: bold; }\n"
+               ".item:hover { color: #c00; } /* <div class=\"item\"> */\n</style>\n"
+               "<script>\nwindow.catalog = { template: '<div class=\"product-item\"><h2 class=\"product-title\">Template product</h2>"
+               "<span class=\"price\">$0.00</span></div>', ready: 1 < 2 };\n</script>\n</head>\n<body>\n"
+               "<header class=\"site-header\">\n<nav><ul class=\"menu\">\n"
+               "<li><a href=\"/\">Home</a></li><li><a href=\"/deals\">Deals</a></li><li><a href=\"/help\">Help</a></li>\n"
+               "</ul></nav>\n</header>\n<main class=\"results-grid\">\n";
+    }
+
+    void appendSectionBreak(size_t index, size_t count, string& out) const {
+        if (index > 0) out += "</section>\n";
+        out += "<section class=\"listing-page\">\n<p class=\"summary\">Showing results ";
+        out += to_string(index + 1);
+        out += " to ";
+        out += to_string(min(index + kPageSize, count));
+        out += " of ";
+        out += to_string(count);
+        out += "</p>\n<!-- <div class=\"product-item\"><h2 class=\"product-title\">Commented out product</h2>"
+               "<span class=\"price\">$1.00</span></div> -->\n"
+               "<aside class=\"sponsored\"><a href=\"/ads/click\">Sponsored &middot; Free shipping on orders over &pound;25</a></aside>\n";
+    }
+
+    void appendFooter(string& out) const {
+        out += "</section>\n</main>\n<footer class=\"site-footer\">\n<p>&copy; Example Store. Prices include VAT.</p>\n"
+               "<script>document.querySelectorAll('.product-item').forEach(function (e) { e.dataset.seen = 1; });</script>\n"
+               "</footer>\n</body>\n</html>\n";
+    }
+};
+
+// Counter-based random numbers. Value n of a stream is mix(key + n * gamma),
+// a pure function of the key and the counter, and a stream's key is a pure
+// function of (seed, index). Any product's stream can be produced alone, on
+// any thread and in any order.
+struct CounterRandom {
+    uint64_t key;
+    uint64_t counter = 0;
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    static CounterRandom stream(uint64_t seed, uint64_t index) {
+        return CounterRandom{mix(seed ^ mix(index + 0x9E3779B97F4A7C15ull))};
+    }
+
+    uint64_t next() { return mix(key + ++counter * 0x9E3779B97F4A7C15ull); }
+
+    size_t below(size_t bound) { return static_cast<size_t>(next() % bound); }
+
+    template <size_t N>
+    const char* pick(const char* const (&choices)[N]) { return choices[below(N)]; }
+};
+
+// Sample products for demos and load tests. Product i depends on (seed, i)
+// alone, so a run gives the same products for any thread count or shard
+// size. Prices follow a typical price per product line, spread from half
+// to double and rounded to the usual .99 / .49 / .00 endings; ratings lean
+// towards 4 and 5 stars, and a few products are unrated. Only integer
+// arithmetic is used, so output is identical across platforms too.
+class SampleGenerator {
+public:
+    explicit SampleGenerator(uint64_t seed = 42) : seed(seed) {}
+
+    // Overwrite `product` with sample product `index`. Reusing one Product
+    // reuses its string capacity.
+    void fill(size_t index, Product& product) const {
+        CounterRandom random = CounterRandom::stream(seed, index);
+        size_t line = random.below(size(catalogwords::lines));
+        const char* brand = random.pick(catalogwords::brands);
+        char series = static_cast<char>('A' + random.below(26));
+        string model = to_string(100 + random.below(900));
+        const char* variant = random.pick(catalogwords::variants);
+
+        product.name.clear();
+        product.name.append(brand).append(" ").append(catalogwords::lines[line]).append(" ");
+        product.name.append(1, series).append(model).append(" ").append(variant);
+
+        // Base price times 50%..200%, most often around 125%
+        uint64_t percent = 50 + random.below(76) + random.below(76);
+        uint64_t dollars = max<uint64_t>(1, kLinePrices[line] * percent / 100);
+        unsigned endingChoice = static_cast<unsigned>(random.below(20));
+        unsigned cents = endingChoice < 12 ? 99 : endingChoice < 15 ? 49 : 0;
+        if (cents == 99 && dollars > 1) dollars--;
+        unsigned currencyChoice = static_cast<unsigned>(random.below(10));
+        product.price = currencyChoice < 8 ? "$" : currencyChoice == 8 ? "€" : "£";
+        product.price += to_string(dollars);
+        product.price += '.';
+        product.price += static_cast<char>('0' + cents / 10);
+        product.price += static_cast<char>('0' + cents % 10);
+
+        // 1.0..5.0, skewed high; 4% are new and unrated ("0.0")
+        unsigned tenths = random.below(25) == 0 ? 0 : 50 - static_cast<unsigned>(random.below(21) * random.below(21) / 10);
+        product.rating.assign(1, static_cast<char>('0' + tenths / 10));
+        product.rating += '.';
+        product.rating += static_cast<char>('0' + tenths % 10);
+
+        product.url = "https://example-store.com/product/";
+        appendSlug(brand, product.url);
+        product.url += '-';
+        appendSlug(catalogwords::lines[line], product.url);
+        product.url += '-';
+        product.url += lowerAscii(series);
+        product.url += model;
+        product.url += '-';
+        product.url += to_string(index + 1);
+    }
+
+    Product product(size_t index) const {
+        Product product;
+        fill(index, product);
+        return product;
+    }
+
+    // Generate products [0, count) in shards on `threads` workers and write
+    // them to `sink` in index order as the shards complete. At most two
+    // shards per worker are held at once. Does not call sink.finish().
+    void write(size_t count, ProductSink& sink, unsigned threads) const {
+        size_t shards = (count + kShardSize - 1) / kShardSize;
+        size_t window = min(shards, static_cast<size_t>(max(1u, threads)) * 2);
+        if (window == 0) return;
+
+        // Slot s % window holds shard s; ready[slot] is its shard number + 1
+        vector<ProductBatch> slots(window);
+        vector<size_t> ready(window, 0);
+        mutex readyLock;
+        condition_variable readySignal;
+
+        ThreadPool pool(max(1u, threads));
+        auto submit = [&](size_t shard) {
+            pool.submit([&, shard] {
+                ProductBatch& batch = slots[shard % window];
+                Product product;
+                size_t end = min(count, (shard + 1) * kShardSize);
+                for (size_t i = shard * kShardSize; i < end; i++) {
+                    fill(i, product);
+                    batch.add(product);
+                }
+                {
+                    lock_guard<mutex> guard(readyLock);
+                    ready[shard % window] = shard + 1;
+                }
+                readySignal.notify_all();
+            });
+        };
+        for (size_t shard = 0; shard < window; shard++) submit(shard);
+
+        for (size_t shard = 0; shard < shards; shard++) {
+            ProductBatch& batch = slots[shard % window];
+            {
+                unique_lock<mutex> guard(readyLock);
+                readySignal.wait(guard, [&] { return ready[shard % window] == shard + 1; });
+            }
+            {
+                StageTimer timer(Metrics::Serialize);
+                for (const auto& product : batch.products) sink.write(product);
+            }
+            batch.clear();
+            if (shard + window < shards) submit(shard + window);
+        }
+    }
+
+    static constexpr size_t kShardSize = 16384;
+
+private:
+    // Typical whole-dollar price of each catalogwords::lines entry
+    static constexpr uint64_t kLinePrices[] = {
+        149, 599, 1099, 129, 399, 119, 69, 799, 99, 199, 59, 99, 899, 249, 79
     };
+    static_assert(size(kLinePrices) == size(catalogwords::lines), "one price per product line");
+
+    uint64_t seed;
+
+    // "Bluetooth Speaker" -> "bluetooth-speaker"
+    static void appendSlug(string_view text, string& out) {
+        for (char c : text) out += c == ' ' ? '-' : lowerAscii(c);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Self-test
+//
+// --selftest runs a corpus of small pages through both engines and compares
+// their CSV and JSON with the golden output stored below. Between them the
+// pages exercise every container, name, price and rating rule of the
+// built-in rules. The exception is "h1-h6 class product title", which the
+// "title" rule before it always shadows. Each page is also checked against
+// the regex reference engine and timed per engine. After that a batch of
+// generated pages is checked the same way; --fuzz N runs N of them.
+//
+// The regex engine has known quirks that are normalized away before
+// comparing:
+//   - Its '.' stops at line breaks, so it gets the page with line breaks
+//     turned into spaces. Cleaning collapses the whitespace again.
+//   - Overlapping container patterns report a product more than once, so
+//     both sides are deduplicated like the engines do and sorted.
+//   - It stops after 100 products, or after a pattern finds 10, so pages
+//     stay below that.
+// Its real defects are avoided rather than normalized: div containers with
+// div fields (their content is cut at the first inner </div>), and products
+// inside comments and scripts. Fixtures that show them skip the comparison.
+//
+// The corpus is compiled into the binary because the program is a single
+// source file with no build system or test framework around it. Anyone
+// holding the binary can run the check.
+// ---------------------------------------------------------------------------
+
+struct SelfTestFixture {
+    const char* name;
+    const char* html;
+    const char* csv;        // golden CSV of both engines
+    const char* domCsv;     // golden CSV of the DOM engine where it differs, else null
+    const char* json;       // golden JSON, or null
+    bool regexComparable;   // false when the page hits a regex defect
+};
+
+const SelfTestFixture kSelfTestFixtures[] = {
+    // div product item; h1-h6 title, a title; span price, $; span rating, out-of
+    {"product-item", R"html(<div class="product-list">
+  <div class="product-item">
+    <h2 class="product-title">iPhone 14 Pro Max 128GB</h2>
+    <span class="price">$1,099.00</span>
+    <span class="rating">4.5</span>
+    <a href="/iphone-14-pro">View Product</a>
+  </div>
+  <div class="product-item featured">
+    <a class="card-title" href="/galaxy-s23">Samsung Galaxy S23 Ultra</a>
+    <p>Now only $1199.99 <small>incl. VAT</small></p>
+    <span class="reviews">4.4 out of 5 stars</span>
+  </div>
+</div>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+iPhone 14 Pro Max 128GB,"$1,099.00",4.5,/iphone-14-pro
+Samsung Galaxy S23 Ultra,$1199.99,4.4,/galaxy-s23
+)csv",
+     nullptr,
+     R"json({
+  "products": [
+    {
+      "name": "iPhone 14 Pro Max 128GB",
+      "price": "$1,099.00",
+      "rating": "4.5",
+      "url": "/iphone-14-pro"
+    },
+    {
+      "name": "Samsung Galaxy S23 Ultra",
+      "price": "$1199.99",
+      "rating": "4.4",
+      "url": "/galaxy-s23"
+    }
+  ]
+}
+)json", true},
+
+    // div product card; h1-h6 name, a name; p price, €; span stars, ratio
+    {"product-card", R"html(<section class="grid">
+  <div class="product-card">
+    <h3 class="name">MacBook Air M2 13-inch</h3>
+    <p class="price">€1,199.00</p>
+    <span class="stars">4.7</span>
+    <a href="/macbook-air">Details</a>
+  </div>
+  <div class="product-card">
+    <a class="product-name" href="/sony-wh1000xm4">Sony WH-1000XM4 Headphones</a>
+    <span class="sale">Sale: €349.99</span>
+    <span class="score">4.6/5</span>
+  </div>
+</section>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+MacBook Air M2 13-inch,"€1,199.00",4.7,/macbook-air
+Sony WH-1000XM4 Headphones,€349.99,4.6,/sony-wh1000xm4
+)csv",
+     nullptr,
+     nullptr, true},
+
+    // article product; a product link, span title; div price, £; div star, Rating:
+    {"article", R"html(<article class="product">
+  <a class="product-link" href="/dell-xps-13">Dell XPS 13 Laptop</a>
+  <div class="price">£999.99</div>
+  <div class="star">4.3</div>
+</article>
+<article class="product">
+  <span class="title">Kindle Paperwhite 11th Gen</span>
+  <div class="offer">Was £149.99, now £129.99</div>
+  <p>Rating: 4.8</p>
+  <a href="/kindle">Buy</a>
+</article>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+Dell XPS 13 Laptop,£999.99,4.3,/dell-xps-13
+Kindle Paperwhite 11th Gen,£149.99,4.8,/kindle
+)csv",
+     nullptr,
+     nullptr, true},
+
+    // li product; div name, span name; USD, INR, ₹; ★
+    {"list-item", R"html(<ul class="results">
+  <li class="product">
+    <div class="name">Nintendo Switch OLED White</div>
+    <span>USD 349.99</span>
+    <span>★ 4.9</span>
+    <a href="/switch-oled">Shop</a>
+  </li>
+  <li class="product">
+    <span class="name">Echo Dot 5th Gen</span>
+    <span>INR 4,499</span>
+  </li>
+  <li class="product">
+    <span class="name">boAt Rockerz 450</span>
+    <span>₹1,499</span>
+    <span>3.9 out of 5</span>
+  </li>
+</ul>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+Nintendo Switch OLED White,USD 349.99,4.9,/switch-oled
+Echo Dot 5th Gen,"INR 4,499",0.0,
+boAt Rockerz 450,"₹1,499",3.9,
+)csv",
+     nullptr,
+     nullptr, true},
+
+    // div item; Price:, Cost:
+    {"item", R"html(<div class="item">
+  <span class="name">Logitech MX Master 3S</span>
+  <span>Price: 99.99</span>
+  <span>Rating: 4.6</span>
+  <a href="/mx-master-3s">More</a>
+</div>
+<div class="item">
+  <h4 class="title">HP LaserJet Pro M404</h4>
+  <span>Cost: 229</span>
+  <span class="rating">4.1</span>
+</div>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+Logitech MX Master 3S,99.99,4.6,/mx-master-3s
+HP LaserJet Pro M404,229,4.1,
+)csv",
+     nullptr,
+     nullptr, true},
+
+    // data-component-type=s-search-result, with the name inside a link
+    {"search-result", R"html(<div data-component-type="s-search-result" data-asin="B0BDHWDR12">
+  <h2 class="a-size-mini"><a class="a-link-normal s-title" href="/dp/B0BDHWDR12"><span>Apple AirPods Pro (2nd Generation)</span></a></h2>
+  <span class="a-price"><span class="a-offscreen">$249.00</span></span>
+  <span class="a-icon-alt">4.7 out of 5 stars</span>
+</div>
+<div data-component-type="s-search-result" data-asin="B09B8V1LZ3">
+  <h2 class="a-size-mini"><a class="a-link-normal s-title" href="/dp/B09B8V1LZ3"><span>Echo Dot (5th Gen, 2022 release)</span></a></h2>
+  <span class="a-price"><span class="a-offscreen">$49.99</span></span>
+</div>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+Apple AirPods Pro (2nd Generation),$249.00,4.7,/dp/B0BDHWDR12
+"Echo Dot (5th Gen, 2022 release)",$49.99,0.0,/dp/B09B8V1LZ3
+)csv",
+     nullptr,
+     nullptr, true},
+
+    // Entities, CSV and JSON escaping, a duplicate link, a name too short
+    // to keep, a name alone (kept with rating 0.0, as it always was), and
+    // products in a script and a comment, which only the regex engine sees
+    {"edge-cases", R"html(<script>var tpl = '<div class="product-item"><h2 class="product-title">Template Product</h2><span class="price">$0.00</span></div>';</script>
+<!-- <div class="product-item"><h2 class="product-title">Commented Product</h2><span class="price">$1.00</span></div> -->
+<div class="product-item">
+  <h2 class="product-title">Bose QuietComfort 45, &quot;Triple Black&quot; &amp; Case</h2>
+  <span class="price">$329.00</span>
+  <a href="/bose-qc45?color=black&amp;ref=list">View</a>
+</div>
+<div class="product-item">
+  <h2 class="product-title">Bose QuietComfort 45 (duplicate listing)</h2>
+  <span class="price">$329.00</span>
+  <a href="/bose-qc45?color=black&amp;ref=list">View</a>
+</div>
+<div class="product-item">
+  <h2 class="product-title">TV</h2>
+  <span class="name">LG UltraWide 34-inch&nbsp;Monitor</span>
+  <span class="rating">4.2</span>
+</div>
+<div class="product-item">
+  <h2 class="product-title">Name Without Price Or Rating</h2>
+</div>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+"Bose QuietComfort 45, ""Triple Black"" & Case",$329.00,0.0,/bose-qc45?color=black&amp;ref=list
+LG UltraWide 34-inch Monitor,,4.2,
+Name Without Price Or Rating,,0.0,
+)csv",
+     nullptr,
+     R"json({
+  "products": [
+    {
+      "name": "Bose QuietComfort 45, \"Triple Black\" & Case",
+      "price": "$329.00",
+      "rating": "0.0",
+      "url": "/bose-qc45?color=black&amp;ref=list"
+    },
+    {
+      "name": "LG UltraWide 34-inch Monitor",
+      "price": "",
+      "rating": "4.2",
+      "url": ""
+    },
+    {
+      "name": "Name Without Price Or Rating",
+      "price": "",
+      "rating": "0.0",
+      "url": ""
+    }
+  ]
+}
+)json", false},
+
+    // A field element holding an element of its own kind: the token engine
+    // stops at the first </div> like the regexes, the DOM engine at the
+    // paired one
+    {"nested-field", R"html(<li class="product">
+  <div class="name">Canon <div class="badge">New</div> EOS R6 Mark II</div>
+  <span class="price">$2,499.00</span>
+  <a href="/canon-eos-r6-ii">View</a>
+</li>
+)html",
+     R"csv(Product Name,Price,Rating,URL
+Canon New,"$2,499.00",0.0,/canon-eos-r6-ii
+)csv",
+     R"csv(Product Name,Price,Rating,URL
+Canon New EOS R6 Mark II,"$2,499.00",0.0,/canon-eos-r6-ii
+)csv",
+     nullptr, false},
+};
+
+// Random listing pages for the differential checks. Page i depends on
+// (seed, i) alone, so a failing page can be rebuilt from the seed and index
+// in the report. A page holds one to four products with unique names and
+// links, in any container the built-in rules know, with the name, price,
+// rating, link and some unrelated markup in random order. Fields that only
+// the regex engine would get wrong (see "Self-test") are not generated.
+class TestPageGenerator {
+public:
+    explicit TestPageGenerator(uint64_t seed = 42) : seed(seed) {}
+
+    string page(size_t index) const {
+        CounterRandom random = CounterRandom::stream(seed, index);
+        string out = "<html><body>\n";
+        if (random.below(2)) {
+            out += "<header><h1 class=\"logo\">Example Store</h1><a href=\"/cart\">Cart</a></header>\n";
+        }
+        out += "<section class=\"results\">\n";
+        size_t count = 1 + random.below(kMaxProducts);
+        for (size_t i = 0; i < count; i++) appendProduct(random, index * kMaxProducts + i, out);
+        out += "</section>\n</body></html>\n";
+        return out;
+    }
+
+    static constexpr size_t kMaxProducts = 4;
+
+private:
+    uint64_t seed;
+
+    void appendProduct(CounterRandom& random, size_t id, string& out) const {
+        static const pair<const char*, const char*> containers[] = {
+            {"div", "data-component-type=\"s-search-result\""},
+            {"div", "class=\"product-item\""},
+            {"div", "class=\"product-card\""},
+            {"article", "class=\"product\""},
+            {"li", "class=\"product\""},
+            {"div", "class=\"item\""},
+        };
+        const auto& container = containers[random.below(size(containers))];
+        string tag = container.first;
+        bool divContainer = tag == "div";
+        if (random.below(8) == 0) {
+            for (char& c : tag) c = static_cast<char>(c - 'a' + 'A');
+        }
+
+        const char* brand = random.pick(catalogwords::brands);
+        const char* line = catalogwords::lines[random.below(size(catalogwords::lines))];
+        string name = string(brand) + " " + line + " " + to_string(id + 1);
+        if (random.below(8) == 0) name += " &amp; Case";
+        string link = "/p/";
+        for (char c : string(brand) + "-" + line) link += c == ' ' ? '-' : lowerAscii(c);
+        link += "-" + to_string(id + 1);
+
+        vector<string> parts;
+        auto element = [&](const string& elementTag, const string& attributes, const string& text) {
+            parts.push_back("<" + elementTag + (attributes.empty() ? "" : " " + attributes) + ">" + text +
+                            "</" + elementTag + ">");
+        };
+        auto linked = [&](const char* classes) { return "class=\"" + string(classes) + "\" href=\"" + link + "\""; };
+
+        // Name; a <div> field only inside containers that are not divs
+        string heading = "h" + to_string(1 + random.below(6));
+        switch (random.below(9)) {
+            case 0: element(heading, random.below(2) ? "class=\"title\"" : "class=\"product-title\"", name); break;
+            case 1: element(heading, random.below(2) ? "class=\"name\"" : "class=\"product-name\"", name); break;
+            case 2: element("a", linked("card-title"), name); break;
+            case 3: element("a", linked("name"), name); break;
+            case 4: element("a", linked("product-link"), name); break;
+            case 5:
+                element(heading, "class=\"a-size-mini\"", "<a " + linked("s-title") + "><span>" + name + "</span></a>");
+                break;
+            case 6: element(divContainer ? "span" : "div", "class=\"name\"", name); break;
+            case 7: element("span", "class=\"title\"", name); break;
+            default: element("span", "class=\"name\"", name); break;
+        }
+
+        // A link of its own when the name is not one, most of the time
+        if (parts.back().find(" href=") == string::npos && random.below(4) != 0) {
+            element("a", random.below(2) ? "href=\"" + link + "\"" : linked("button"), "View");
+        }
+
+        // Price, or none
+        string amount = to_string(1 + random.below(1500)) + "." + to_string(10 + random.below(90));
+        switch (random.below(12)) {
+            case 0: element("span", "class=\"price\"", "$" + amount); break;
+            case 1: element(divContainer ? "span" : "div", "class=\"price\"", "£" + amount); break;
+            case 2: element("p", "class=\"price\"", "€" + amount); break;
+            case 3: element("span", "", "$" + amount); break;
+            case 4: element("span", "", "€" + amount); break;
+            case 5: element("span", "", "£" + amount); break;
+            case 6: element("span", "", "₹" + amount); break;
+            case 7: element("span", "", "USD " + amount); break;
+            case 8: element("span", "", "INR " + amount); break;
+            case 9: element("p", "", "Price: " + amount); break;
+            case 10: element("p", "", "Cost: " + amount); break;
+            default: break;
+        }
+
+        // Rating, or none
+        string rating = to_string(1 + random.below(4)) + "." + to_string(random.below(10));
+        switch (random.below(9)) {
+            case 0: element("span", "class=\"rating\"", rating); break;
+            case 1: element(divContainer ? "span" : "div", "class=\"star\"", rating); break;
+            case 2: element("span", "class=\"stars\"", rating); break;
+            case 3: element("span", "", rating + " out of 5 stars"); break;
+            case 4: element("span", "", rating + "/5"); break;
+            case 5: element("span", "", "Rating: " + rating); break;
+            case 6: element("span", "", "★ " + rating); break;
+            default: break;
+        }
+
+        // Markup no rule looks at
+        static const char* const noise[] = {
+            "<em>New</em>", "<img src=\"/img/thumb.jpg\" alt=\"\">", "<br>", "<small>Free shipping</small>",
+            "<!-- ad slot -->"
+        };
+        for (size_t i = random.below(3); i > 0; i--) parts.push_back(random.pick(noise));
+
+        for (size_t i = parts.size(); i > 1; i--) swap(parts[i - 1], parts[random.below(i)]);
+        static const char* const separators[] = {"\n  ", "", " "};
+        const char* separator = random.pick(separators);
+        out += "<" + tag + " " + container.second + ">";
+        for (const string& part : parts) out += separator + part;
+        out += separator;
+        out += "</" + tag + ">\n";
+    }
+};
+
+// Used as a library: construct with a rule set (or the built-in rules), set
+// a Logger (Logger::silent() for none) and call extractProducts() on each
+// page. Extraction does no console I/O of its own and may run on several
+// threads at once. The process* functions drive whole runs for the CLI.
+class EcommerceScraper {
+private:
+    // Compiled extraction rules; immutable and shared with other scrapers
+    shared_ptr<const ExtractionRules> rules;
+
+    // Per-document progress messages; turned off when scraping in parallel
+    bool verbose = true;
+
+    // Destination of every progress, status and error message
+    shared_ptr<const Logger> logger = make_shared<Logger>();
+
+    // Worker threads for batch mode; 0 means one per core
+    unsigned threads = 0;
+
+    // OutputFormat flags written by processData / processBatch / processStream
+    unsigned formats = FormatCSV | FormatJSON;
+
+    // Extraction results of earlier runs, if enabled; shared by batch workers
+    shared_ptr<ExtractionCache> cache;
+
+    // Product link normalization (off when null) and the base URL for
+    // documents that do not carry their own
+    shared_ptr<const UrlNormalizer> urlNormalizer;
+    string defaultBaseUrl;
+
+    // Filter / sort / top-K applied to everything written out (none when null)
+    shared_ptr<const ProductQuery> query;
+
+    // Per-site rules picked by page URL; pages of other sites use `rules`
+    shared_ptr<SiteProfiles> siteProfiles;
+
+    // How extractProducts evaluates the rules; rule sets with css rules
+    // always use the DOM engine
+    ExtractionEngine engine = ExtractionEngine::Tokens;
+
+    // Seed of createSampleData / processSample; a seed always gives the
+    // same products
+    uint64_t sampleSeed = 42;
 
 public:
-    EcommerceScraper() {
-        srand(static_cast<unsigned int>(time(nullptr)));
+    explicit EcommerceScraper(shared_ptr<const ExtractionRules> extractionRules = ExtractionRules::defaults())
+        : rules(move(extractionRules)) {}
+
+    const ExtractionRules& extractionRules() const { return *rules; }
+
+    void setRules(shared_ptr<const ExtractionRules> extractionRules) {
+        rules = move(extractionRules);
+    }
+
+    void setVerbose(bool enabled) { verbose = enabled; }
+    void setThreads(unsigned count) { threads = count; }
+    void setOutputFormats(unsigned outputFormats) { formats = outputFormats; }
+    void setCache(shared_ptr<ExtractionCache> extractionCache) { cache = move(extractionCache); }
+    void setLogger(shared_ptr<const Logger> messageLogger) { logger = move(messageLogger); }
+    void setUrlNormalizer(shared_ptr<const UrlNormalizer> normalizer) { urlNormalizer = move(normalizer); }
+    void setBaseUrl(string url) { defaultBaseUrl = move(url); }
+    void setQuery(shared_ptr<const ProductQuery> productQuery) { query = move(productQuery); }
+    void setSiteProfiles(shared_ptr<SiteProfiles> profiles) { siteProfiles = move(profiles); }
+    void setEngine(ExtractionEngine extractionEngine) { engine = extractionEngine; }
+    void setSampleSeed(uint64_t seed) { sampleSeed = seed; }
+
+    bool usesDom(const ExtractionRules& extraction) const {
+        return engine == ExtractionEngine::Dom || extraction.usesSelectors();
     }
 
     // Clean and extract text from HTML tags
     string cleanText(const string& text) {
+        string cleaned;
+        appendCleanText(text, cleaned);
+        return cleaned;
+    }
+
+    // Escape text for CSV format
+    string escapeCSV(const string& text) {
+        string escaped;
+        appendCSVField(text, escaped);
+        return escaped;
+    }
+
+    // Regex versions of cleanText / escapeCSV, kept as the reference for the
+    // text-cleaning benchmark
+    string cleanTextRegex(const string& text) {
         string cleaned = text;
         
         // Remove HTML tags
@@ -95,8 +6084,7 @@ public:
         return cleaned;
     }
 
-    // Escape text for CSV format
-    string escapeCSV(const string& text) {
+    string escapeCSVRegex(const string& text) {
         string escaped = text;
         
         // If text contains comma, quote, or newline, wrap in quotes
@@ -109,87 +6097,138 @@ public:
             escaped = regex_replace(escaped, quotes, "\"\"");
             escaped = "\"" + escaped + "\"";
         }
-        
-        return escaped;
+        
+        return escaped;
+    }
+
+    // Extract products from HTML content
+    vector<Product> extractProducts(const string& html) {
+        return extractProducts(html, *rules);
+    }
+
+    vector<Product> extractProducts(const string& html, const ExtractionRules& extraction) {
+        ProductBatch batch;
+        extractProducts(html, extraction, batch);
+
+        vector<Product> products;
+        products.reserve(batch.size());
+        for (const auto& view : batch.products) products.push_back(view.toProduct());
+        return products;
+    }
+
+    // Extract with the scraper's own rules into batch
+    void extractProducts(string_view source, ProductBatch& batch) {
+        extractProducts(source, *rules, batch);
+    }
+
+    // Zero-copy extraction: product fields point into `html` (or into the
+    // batch when cleaning rewrote them), so `html` must outlive the batch.
+    // Pass a batch whose source owns `html` to tie the two together. Runs
+    // the token engine, or the DOM engine when usesDom(extraction).
+    void extractProducts(string_view source, const ExtractionRules& extraction, ProductBatch& batch) {
+        StageTimer timer(Metrics::ContainerMatch);
+        const TokenRuleSet& tokenRules = extraction.tokens();
+        RuleCounters* counters = Metrics::instance().countersFor(extraction);
+        vector<ProductView>& products = batch.products;
+        size_t productsBefore = products.size();
+
+        // Temporaries for this document, released together on return
+        DocumentArena arena;
+        pmr::memory_resource* memory = arena.resource();
+
+        // One pass over the document; every rule below works on these tokens
+        TokenList tokens(memory);
+        HtmlTokenizer::tokenize(source, tokens);
+
+        if (verbose) logger->info() << "Analyzing HTML content...";
+
+        FingerprintSet seen(memory);
+        pmr::vector<size_t> foundPerPattern(tokenRules.containers.size(), 0, memory);
+        pmr::string scratch(memory);
+        size_t duplicates = 0;
+
+        // Links resolve against the document URL, or the first <base href>
+        UrlContext urls;
+        pmr::string baseUrl(memory);
+        bool baseSeen = false;
+        if (urlNormalizer) {
+            urls.normalizer = urlNormalizer.get();
+            urls.base = batch.baseUrl.empty() ? string_view(defaultBaseUrl) : string_view(batch.baseUrl);
+        }
+        auto useBase = [&](string_view href) {
+            urls.normalizer->normalize(href, urls.base, baseUrl);
+            urls.base = baseUrl;
+            baseSeen = true;
+        };
+
+        auto add = [&](size_t rule, const ProductView& product) {
+            // Only add products with meaningful data
+            if (!isMeaningfulProduct(product)) return false;
+            if (seen.insert(productFingerprint(product))) {
+                products.push_back(product);
+                foundPerPattern[rule]++;
+            } else {
+                duplicates++;
+            }
+            return true;
+        };
+
+        if (usesDom(extraction)) {
+            DomTree tree(memory);
+            tree.build(source, tokens);
+            DomContainerWalker walker(tokenRules, counters, memory);
+            auto onContainer = [&](size_t rule, uint32_t node) {
+                return add(rule, extractDomProductFields(tokenRules, tree, node, batch, scratch, counters, urls));
+            };
+            for (uint32_t i = 0; i < tree.size(); i++) {
+                walker.visit(tree, i, onContainer);
+                string_view href;
+                if (urls.normalizer && !baseSeen && equalsIgnoreCase(tree.name(i), "base") &&
+                    tree.attribute(i, "href", href)) {
+                    useBase(href);
+                }
+            }
+            walker.finish(tree, onContainer);
+        } else {
+            // All container rules are scheduled together in one pass
+            ContainerScheduler scheduler(tokenRules, counters, memory);
+            for (size_t i = 0; i < tokens.size(); i++) {
+                string_view href;
+                if (urls.normalizer && !baseSeen && findBaseHref(source, tokens[i], href)) useBase(href);
+                scheduler.push(source, tokens, i, [&](size_t rule, size_t open, size_t close) {
+                    string_view content = source.substr(tokens[open].end, tokens[close].begin - tokens[open].end);
+                    return add(rule, extractProductFields(tokenRules, source, tokens, open + 1, close, content,
+                                                          batch, scratch, counters, urls));
+                });
+            }
+        }
+
+        if (counters) Metrics::instance().countDocument(source.size(), products.size() - productsBefore);
+
+        if (verbose && logger->enabled(Logger::Info)) {
+            for (size_t patternIndex = 0; patternIndex < foundPerPattern.size(); patternIndex++) {
+                logger->info() << "Pattern " << (patternIndex + 1) << " found " << foundPerPattern[patternIndex] << " products.";
+            }
+            if (duplicates > 0) logger->info() << "Skipped " << duplicates << " duplicate products.";
+        }
     }
 
-    // Extract products from HTML content
-    vector<Product> extractProducts(const string& html) {
+    // Reference implementation of extractProducts built on std::regex. Kept for
+    // comparing the tokenizer engine against the original behaviour. css
+    // rules have no regex form and are left out.
+    vector<Product> extractProductsRegex(const string& html) {
+        return extractProductsRegex(html, *rules);
+    }
+
+    vector<Product> extractProductsRegex(const string& html, const ExtractionRules& extraction) {
+        const ExtractionRules::RegexTables& tables = extraction.regexes();
+        const vector<regex>& productContainerPatterns = tables.containers;
+        const vector<regex>& namePatterns = tables.names;
+        const vector<regex>& pricePatterns = tables.prices;
+        const vector<regex>& ratingPatterns = tables.ratings;
         vector<Product> products;
         
-        // Multiple patterns for different e-commerce structures
-        vector<regex> productContainerPatterns = {
-            // Amazon-like patterns
-            regex("<div[^>]*data-component-type=\"s-search-result\"[^>]*>(.*?)</div>\\s*</div>\\s*</div>", 
-                  regex_constants::icase),
-            
-            // Generic product containers
-            regex("<div[^>]*class=\"[^\"]*product[^\"]*item[^\"]*\"[^>]*>(.*?)</div>", 
-                  regex_constants::icase),
-            regex("<div[^>]*class=\"[^\"]*product[^\"]*card[^\"]*\"[^>]*>(.*?)</div>", 
-                  regex_constants::icase),
-            regex("<article[^>]*class=\"[^\"]*product[^\"]*\"[^>]*>(.*?)</article>", 
-                  regex_constants::icase),
-            
-            // List item patterns
-            regex("<li[^>]*class=\"[^\"]*product[^\"]*\"[^>]*>(.*?)</li>", 
-                  regex_constants::icase),
-            
-            // Generic item patterns
-            regex("<div[^>]*class=\"[^\"]*item[^\"]*\"[^>]*>(.*?)</div>", 
-                  regex_constants::icase)
-        };
-        
-        // Name extraction patterns
-        vector<regex> namePatterns = {
-            // Heading patterns
-            regex("<h[1-6][^>]*class=\"[^\"]*title[^\"]*\"[^>]*>(.*?)</h[1-6]>", regex_constants::icase),
-            regex("<h[1-6][^>]*class=\"[^\"]*name[^\"]*\"[^>]*>(.*?)</h[1-6]>", regex_constants::icase),
-            regex("<h[1-6][^>]*class=\"[^\"]*product[^\"]*title[^\"]*\"[^>]*>(.*?)</h[1-6]>", regex_constants::icase),
-            
-            // Link patterns
-            regex("<a[^>]*class=\"[^\"]*title[^\"]*\"[^>]*>(.*?)</a>", regex_constants::icase),
-            regex("<a[^>]*class=\"[^\"]*name[^\"]*\"[^>]*>(.*?)</a>", regex_constants::icase),
-            regex("<a[^>]*class=\"[^\"]*product[^\"]*link[^\"]*\"[^>]*>(.*?)</a>", regex_constants::icase),
-            
-            // Span and div patterns
-            regex("<span[^>]*class=\"[^\"]*title[^\"]*\"[^>]*>(.*?)</span>", regex_constants::icase),
-            regex("<div[^>]*class=\"[^\"]*name[^\"]*\"[^>]*>(.*?)</div>", regex_constants::icase),
-            regex("<span[^>]*class=\"[^\"]*name[^\"]*\"[^>]*>(.*?)</span>", regex_constants::icase)
-        };
-        
-        // Price extraction patterns
-        vector<regex> pricePatterns = {
-            // Class-based patterns
-            regex("<span[^>]*class=\"[^\"]*price[^\"]*\"[^>]*>(.*?)</span>", regex_constants::icase),
-            regex("<div[^>]*class=\"[^\"]*price[^\"]*\"[^>]*>(.*?)</div>", regex_constants::icase),
-            regex("<p[^>]*class=\"[^\"]*price[^\"]*\"[^>]*>(.*?)</p>", regex_constants::icase),
-            
-            // Currency patterns
-            regex("\\$\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            regex("₹\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            regex("€\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            regex("£\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            regex("USD\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            regex("INR\\s*[\\d,]+\\.?\\d*", regex_constants::icase),
-            
-            // Generic price patterns
-            regex("Price:\\s*([\\d,]+\\.?\\d*)", regex_constants::icase),
-            regex("Cost:\\s*([\\d,]+\\.?\\d*)", regex_constants::icase)
-        };
-        
-        // Rating extraction patterns
-        vector<regex> ratingPatterns = {
-            regex("<span[^>]*class=\"[^\"]*rating[^\"]*\"[^>]*>([0-9.]+)</span>", regex_constants::icase),
-            regex("<div[^>]*class=\"[^\"]*star[^\"]*\"[^>]*>([0-9.]+)</div>", regex_constants::icase),
-            regex("<span[^>]*class=\"[^\"]*star[^\"]*\"[^>]*>([0-9.]+)</span>", regex_constants::icase),
-            regex("([0-9.]+)\\s*out\\s*of\\s*[0-9]+", regex_constants::icase),
-            regex("([0-9.]+)\\s*/\\s*[0-9]+", regex_constants::icase),
-            regex("Rating:\\s*([0-9.]+)", regex_constants::icase),
-            regex("★\\s*([0-9.]+)", regex_constants::icase)
-        };
-        
-        cout << "Analyzing HTML content..." << endl;
+        if (verbose) logger->info() << "Analyzing HTML content...";
         
         // Try different container patterns
         for (size_t patternIndex = 0; patternIndex < productContainerPatterns.size(); patternIndex++) {
@@ -242,9 +6281,8 @@ public:
                 }
                 
                 // Extract URL
-                regex urlPattern("<a[^>]*href=\"([^\"]*)\"", regex_constants::icase);
                 smatch urlMatch;
-                if (regex_search(productHtml, urlMatch, urlPattern)) {
+                if (regex_search(productHtml, urlMatch, tables.url)) {
                     product.url = urlMatch[1];
                 }
                 
@@ -255,7 +6293,7 @@ public:
                 }
             }
             
-            cout << "Pattern " << (patternIndex + 1) << " found " << foundWithThisPattern << " products." << endl;
+            if (verbose) logger->info() << "Pattern " << (patternIndex + 1) << " found " << foundWithThisPattern << " products.";
             
             // If we found a good number of products, we can break
             if (products.size() >= 10) {
@@ -266,114 +6304,506 @@ public:
         return products;
     }
 
-    // Generate sample data for demonstration
+    // Generate sample data for demonstration (see SampleGenerator)
     vector<Product> createSampleData(int count = 20) {
-        vector<Product> products;
-        
-        for (int i = 0; i < min(count, static_cast<int>(sampleNames.size())); i++) {
-            Product product;
-            product.name = sampleNames[i];
-            product.price = samplePrices[i];
-            
-            // Generate random rating between 3.0 and 5.0
-            double rating = 3.0 + (rand() % 21) / 10.0;
-            ostringstream ratingStream;
-            ratingStream << fixed << setprecision(1) << rating;
-            product.rating = ratingStream.str();
-            
-            product.url = "https://example-store.com/product/" + to_string(i + 1);
-            
-            products.push_back(product);
-        }
-        
+        SampleGenerator generator(sampleSeed);
+        vector<Product> products(static_cast<size_t>(max(count, 0)));
+        for (size_t i = 0; i < products.size(); i++) generator.fill(i, products[i]);
         return products;
     }
 
-    // Load HTML from file
-    string loadHTMLFromFile(const string& filename) {
-        ifstream file(filename);
-        if (!file.is_open()) {
-            cerr << "Error: Could not open file " << filename << endl;
-            return "";
+    // Generate `count` sample products straight into the output files, on
+    // the batch worker threads. The files are the same for any thread count.
+    // Throws runtime_error when an output cannot be written.
+    size_t processSample(size_t count, const string& outputFile) {
+        unsigned threadCount = threads ? threads : max(1u, thread::hardware_concurrency());
+        unique_ptr<ProductSink> sinks = openOutput(outputFile);
+        auto started = chrono::steady_clock::now();
+        SampleGenerator(sampleSeed).write(count, *sinks, threadCount);
+        sinks->finish();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        logger->info() << "✓ Saved " << sinks->count() << " of " << count << " sample products (seed " << sampleSeed << ") to "
+                       << sinks->description() << " in " << fixed << setprecision(2) << seconds << " s, "
+                       << setprecision(0) << count / max(seconds, 1e-9) << " products/s";
+        return count;
+    }
+
+    // Load HTML from file. The file is memory-mapped (or read into a single
+    // buffer) and shared with every product extracted from it.
+    shared_ptr<const HtmlSource> loadHTMLFromFile(const string& filename) {
+        shared_ptr<const HtmlSource> source;
+        try {
+            source = HtmlSource::open(filename);
+        } catch (const exception& e) {
+            logger->error() << e.what();
+            return nullptr;
         }
         
-        string html, line;
-        while (getline(file, line)) {
-            html += line + "\n";
+        logger->info() << "Loaded " << source->size() << " characters from " << filename
+                       << (source->isMapped() ? " (memory-mapped)" : "");
+        return source;
+    }
+
+    // Write every row to a sink and finish it. Works on Product or
+    // ProductView rows; errors are reported rather than thrown.
+    template <typename Rows>
+    bool saveToSink(const Rows& products, ProductSink& sink) {
+        try {
+            StageTimer timer(Metrics::Serialize);
+            for (const auto& product : products) sink.write(ProductView(product));
+            sink.finish();
+        } catch (const exception& e) {
+            logger->error() << e.what();
+            return false;
         }
-        file.close();
-        
-        cout << "Loaded " << html.length() << " characters from " << filename << endl;
-        return html;
+        return true;
     }
 
     // Save products to CSV
-    void saveToCSV(const vector<Product>& products, const string& filename) {
-        ofstream file(filename);
-        
-        if (!file.is_open()) {
-            cerr << "Error: Could not create CSV file: " << filename << endl;
-            return;
-        }
-        
-        // Write CSV header
-        file << "Product Name,Price,Rating,URL\n";
-        
-        // Write product data
-        for (const auto& product : products) {
-            file << escapeCSV(product.name) << ","
-                 << escapeCSV(product.price) << ","
-                 << escapeCSV(product.rating) << ","
-                 << escapeCSV(product.url) << "\n";
+    template <typename Rows>
+    void saveToCSV(const Rows& products, const string& filename) {
+        try {
+            CsvSink sink(filename);
+            if (saveToSink(products, sink)) {
+                logger->info() << "\n✓ Successfully saved " << products.size() << " products to " << filename;
+            }
+        } catch (const exception&) {
+            logger->error() << "Could not create CSV file: " << filename;
         }
-        
-        file.close();
-        cout << "\n✓ Successfully saved " << products.size() << " products to " << filename << endl;
     }
 
     // Save products to JSON format as well
-    void saveToJSON(const vector<Product>& products, const string& filename) {
-        ofstream file(filename);
-        
-        if (!file.is_open()) {
-            cerr << "Error: Could not create JSON file: " << filename << endl;
+    template <typename Rows>
+    void saveToJSON(const Rows& products, const string& filename) {
+        try {
+            JsonSink sink(filename);
+            if (saveToSink(products, sink)) {
+                logger->info() << "✓ Successfully saved " << products.size() << " products to " << filename;
+            }
+        } catch (const exception&) {
+            logger->error() << "Could not create JSON file: " << filename;
+        }
+    }
+
+    // Expand a batch input into the list of files to scrape: a directory
+    // (every .html/.htm file below it), a glob such as pages/*.html, or a
+    // manifest file listing one path per line ('#' starts a comment)
+    vector<string> collectBatchInputs(const string& spec) {
+        namespace fs = std::filesystem;
+        vector<string> files;
+        fs::path path(spec);
+
+        auto isHtmlFile = [](const fs::path& file) {
+            string extension = file.extension().string();
+            return equalsIgnoreCase(extension, ".html") || equalsIgnoreCase(extension, ".htm");
+        };
+
+        if (spec.find_first_of("*?") != string::npos) {
+            fs::path directory = path.parent_path();
+            if (directory.empty()) directory = ".";
+            string pattern = path.filename().string();
+            for (const auto& entry : fs::directory_iterator(directory)) {
+                if (entry.is_regular_file() && wildcardMatch(entry.path().filename().string(), pattern)) {
+                    files.push_back(entry.path().string());
+                }
+            }
+            sort(files.begin(), files.end());
+        } else if (fs::is_directory(path)) {
+            for (const auto& entry : fs::recursive_directory_iterator(path)) {
+                if (entry.is_regular_file() && isHtmlFile(entry.path())) {
+                    files.push_back(entry.path().string());
+                }
+            }
+            sort(files.begin(), files.end());
+        } else if (fs::is_regular_file(path) && isHtmlFile(path)) {
+            files.push_back(spec);
+        } else if (fs::is_regular_file(path)) {
+            ifstream manifest(spec);
+            string line;
+            while (getline(manifest, line)) {
+                size_t start = line.find_first_not_of(" \t\r");
+                if (start == string::npos || line[start] == '#') continue;
+                size_t end = line.find_last_not_of(" \t\r");
+                files.push_back(line.substr(start, end - start + 1));
+            }
+        } else {
+            throw runtime_error("No such file or directory: " + spec);
+        }
+
+        return files;
+    }
+
+    // The output sinks for outputFile, behind the query stage when one is set
+    unique_ptr<ProductSink> openOutput(const string& outputFile) {
+        unique_ptr<ProductSink> sinks = openSinks(outputFile, formats);
+        if (query && !query->empty()) sinks.reset(new QuerySink(query, move(sinks), threads));
+        return sinks;
+    }
+
+    // Extract the products of batch.source into batch, reusing the cached
+    // result when the same page was extracted with the same rules before
+    void extractDocument(ProductBatch& batch, const ExtractionRules& extraction) {
+        string_view page = batch.source->view();
+        string_view url = batch.baseUrl.empty() ? string_view(defaultBaseUrl) : string_view(batch.baseUrl);
+
+        // A page of a known site runs only that site's rules
+        shared_ptr<const ProfileSet> profiles = siteProfiles ? siteProfiles->current() : nullptr;
+        const SiteProfile* profile = profiles && !url.empty() ? profiles->find(url) : nullptr;
+        const ExtractionRules& chosen = profile ? *profile->rules : extraction;
+        auto extract = [&] {
+            size_t first = batch.size();
+            extractProducts(page, chosen, batch);
+            if (profile && profile->rewritesPrices()) {
+                for (size_t i = first; i < batch.size(); i++) profile->applyPriceFormat(batch.products[i]);
+            }
+        };
+        if (!cache) {
+            extract();
             return;
         }
-        
-        file << "{\n  \"products\": [\n";
-        
-        for (size_t i = 0; i < products.size(); i++) {
-            file << "    {\n";
-            file << "      \"name\": \"" << products[i].name << "\",\n";
-            file << "      \"price\": \"" << products[i].price << "\",\n";
-            file << "      \"rating\": \"" << products[i].rating << "\",\n";
-            file << "      \"url\": \"" << products[i].url << "\"\n";
-            file << "    }";
-            if (i < products.size() - 1) file << ",";
-            file << "\n";
+
+        string context;
+        if (urlNormalizer) context = urlNormalizer->description() + "\n" + string(url);
+        if (profile) context += "\n" + profile->description();
+        if (usesDom(chosen)) context += "\nengine dom";
+        string key = ExtractionCache::key(page, chosen, context);
+        if (auto cached = cache->lookup(key)) {
+            for (size_t i = 0; i < cached->size(); i++) batch.add(cached->row(i));
+            if (verbose) logger->info() << "Loaded " << cached->size() << " products from the cache.";
+            return;
         }
-        
-        file << "  ]\n}\n";
-        file.close();
-        
-        cout << "✓ Successfully saved " << products.size() << " products to " << filename << endl;
+
+        // Pages without products are cached too, so they are not re-parsed
+        size_t first = batch.size();
+        extract();
+        try {
+            cache->store(key, batch.products, first);
+        } catch (const exception& e) {
+            logger->warning() << "could not cache products: " << e.what();
+        }
+    }
+
+    // Scrape one HTML file into the output files. Unlike processData there
+    // is no sample-data fallback: a page without products writes empty files.
+    // Throws runtime_error when the input cannot be read or an output written.
+    size_t processFile(const string& input, const string& outputFile) {
+        ProductBatch batch;
+        batch.source = HtmlSource::open(input);
+        extractDocument(batch, *rules);
+        if (cache) logger->info() << "Cache: " << cache->summary();
+
+        unique_ptr<ProductSink> sinks = openOutput(outputFile);
+        {
+            StageTimer timer(Metrics::Serialize);
+            for (const auto& product : batch.products) sinks->write(product);
+            sinks->finish();
+        }
+        logger->info() << "✓ Successfully saved " << sinks->count() << " products to " << sinks->description();
+        return sinks->count();
+    }
+
+    // Scrape many files in parallel and merge the products, in input order,
+    // into one CSV/JSON pair. A file that cannot be read or parsed is
+    // reported and skipped without affecting the others. At most two files
+    // per thread are held at once, so memory does not grow with the number
+    // of files.
+    size_t processBatch(const vector<string>& files, const string& outputFile) {
+        unsigned threadCount = threads ? threads : max(1u, thread::hardware_concurrency());
+
+        struct FileResult {
+            ProductBatch batch;
+            size_t bytes = 0;
+            string error;
+        };
+        shared_ptr<const ExtractionRules> extraction = rules;
+        unique_ptr<ProductSink> sinks = openOutput(outputFile);
+
+        // File i goes to slot i % window; done[slot] is its file number + 1.
+        // Slots are written out in input order as soon as every earlier file
+        // is done, then reused for the file `window` places further on.
+        size_t window = min(files.size(), static_cast<size_t>(threadCount) * 2);
+        vector<FileResult> results(window);
+        mutex doneLock;
+        condition_variable doneSignal;
+        vector<size_t> done(window, 0);
+
+        bool wasVerbose = verbose;
+        verbose = false;
+        auto started = chrono::steady_clock::now();
+        size_t totalBytes = 0;
+        size_t failed = 0;
+        {
+            ThreadPool pool(threadCount);
+            auto submit = [&](size_t i) {
+                pool.submit([&, i] {
+                    FileResult& result = results[i % window];
+                    try {
+                        result.batch.source = HtmlSource::open(files[i]);
+                        result.bytes = result.batch.source->size();
+                        extractDocument(result.batch, *extraction);
+                        result.batch.detachFromSource();
+                    } catch (const exception& e) {
+                        result.error = e.what();
+                        result.batch.clear();
+                    } catch (...) {
+                        result.error = "unknown error";
+                        result.batch.clear();
+                    }
+                    {
+                        lock_guard<mutex> guard(doneLock);
+                        done[i % window] = i + 1;
+                    }
+                    doneSignal.notify_one();
+                });
+            };
+            for (size_t i = 0; i < window; i++) submit(i);
+
+            for (size_t i = 0; i < files.size(); i++) {
+                {
+                    unique_lock<mutex> guard(doneLock);
+                    doneSignal.wait(guard, [&] { return done[i % window] == i + 1; });
+                }
+                FileResult& result = results[i % window];
+                totalBytes += result.bytes;
+                if (!result.error.empty()) {
+                    if (failed < 20) logger->error() << files[i] << ": " << result.error;
+                    failed++;
+                } else {
+                    for (const auto& product : result.batch.products) sinks->write(product);
+                }
+                result.batch.clear();
+                result.bytes = 0;
+                result.error.clear();
+                if (i + window < files.size()) submit(i + window);
+            }
+        }
+        sinks->finish();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        verbose = wasVerbose;
+
+        if (failed > 20) logger->error() << "... and " << (failed - 20) << " more failed files.";
+
+        logger->info() << "Scraped " << files.size() << " files (" << fixed << setprecision(1)
+                       << totalBytes / 1048576.0 << " MB) with " << threadCount << " threads in "
+                       << setprecision(2) << seconds << " s: " << sinks->count() << " products, "
+                       << failed << " failed.";
+        if (cache) logger->info() << "Cache: " << cache->summary();
+        logger->info() << "✓ Successfully saved " << sinks->count() << " products to " << sinks->description();
+        return sinks->count();
+    }
+
+    // Extract products from a stream of any size, read in fixed-size blocks.
+    // Each product is handed to onProduct as soon as its container closes;
+    // memory stays around blockSize + memoryBudget.
+    size_t extractProductsStreaming(istream& in, const StreamingExtractor::ProductCallback& onProduct,
+                                    size_t memoryBudget = 64u << 20, size_t blockSize = 1u << 20) {
+        shared_ptr<const ProfileSet> profiles = siteProfiles ? siteProfiles->current() : nullptr;
+        const SiteProfile* profile = profiles && !defaultBaseUrl.empty() ? profiles->find(defaultBaseUrl) : nullptr;
+        StreamingExtractor::ProductCallback emit = onProduct;
+        if (profile && profile->rewritesPrices()) {
+            emit = [&onProduct, profile](const ProductView& product) {
+                ProductView formatted = product;
+                profile->applyPriceFormat(formatted);
+                onProduct(formatted);
+            };
+        }
+        const shared_ptr<const ExtractionRules>& chosen = profile ? profile->rules : rules;
+        if (chosen->usesSelectors()) {
+            throw runtime_error(chosen->origin() + " has css rules, which need the whole document; "
+                                "use --input instead of --stream");
+        }
+        StreamingExtractor extractor(chosen, emit, memoryBudget);
+        if (urlNormalizer) extractor.setUrls(urlNormalizer.get(), defaultBaseUrl);
+        vector<char> block(blockSize);
+        size_t totalBytes = 0;
+        while (in) {
+            streamsize got;
+            {
+                StageTimer timer(Metrics::Load);
+                in.read(block.data(), static_cast<streamsize>(block.size()));
+                got = in.gcount();
+            }
+            if (got <= 0) break;
+            totalBytes += static_cast<size_t>(got);
+            extractor.feed(string_view(block.data(), static_cast<size_t>(got)));
+        }
+        extractor.finish();
+        if (Metrics::enabled()) Metrics::instance().countDocument(totalBytes, extractor.productCount());
+
+        if (extractor.droppedContainers() > 0) {
+            logger->warning() << "skipped " << extractor.droppedContainers()
+                              << " product containers that were unterminated or larger than the memory budget.";
+        }
+        return extractor.productCount();
+    }
+
+    // Stream one HTML file straight into the output sinks without holding
+    // the document or the product list in memory
+    size_t processStream(const string& input, const string& outputFile, size_t memoryBudget = 64u << 20) {
+        ifstream in(input, ios::binary);
+        if (!in.is_open()) {
+            logger->error() << "Could not open file " << input;
+            return 0;
+        }
+
+        unique_ptr<ProductSink> sinks = openOutput(outputFile);
+        size_t count = extractProductsStreaming(in, [&](const ProductView& product) {
+            sinks->write(product);
+        }, memoryBudget);
+        sinks->finish();
+
+        logger->info() << "✓ Streamed " << count << " products from " << input << " to " << sinks->description()
+                       << (sinks->count() != count ? " (" + to_string(sinks->count()) + " kept by the query)" : "");
+        return count;
+    }
+
+    // Extract every page of a page record stream (see PageRecordReader) and
+    // write the products as NDJSON to output ("-" for stdout), each tagged
+    // with its page URL. Reading, extraction and writing run on three
+    // threads; products are flushed page by page. Returns the number of
+    // products; throws runtime_error when the stream cannot be read or the
+    // output cannot be written.
+    size_t processPageStream(FILE* input, PageRecordReader::Format format, const string& output) {
+        struct Page {
+            size_t number = 0;
+            string url;
+            ProductBatch batch;
+            string error;
+        };
+        using PagePointer = unique_ptr<Page>;   // null marks the end of the stream
+
+        // Pages in flight per queue; bounds memory to a few dozen documents
+        const size_t queuePages = 32;
+        SpscQueue<PagePointer> toExtract(queuePages);
+        SpscQueue<PagePointer> toWrite(queuePages);
+        atomic<bool> stop{false};
+        shared_ptr<const ExtractionRules> extraction = rules;
+
+        // Pages are written as soon as they are extracted, so a query can
+        // filter and truncate but not sort
+        if (query && query->sorted()) {
+            throw invalid_argument("page streams are written as they arrive and cannot be sorted");
+        }
+        const ProductQuery* filter = query && !query->empty() ? query.get() : nullptr;
+        size_t passed = 0;
+        NdjsonSink sink(output);
+
+        PageRecordReader reader(input, format);
+        string readError;
+        thread readThread([&] {
+            try {
+                PageRecord record;
+                for (size_t number = 1; reader.next(record); number++) {
+                    PagePointer page(new Page());
+                    page->number = number;
+                    page->url = move(record.url);
+                    page->batch.baseUrl = page->url;
+                    page->batch.source = HtmlSource::fromString(move(record.html));
+                    if (!toExtract.push(move(page), stop)) return;
+                }
+            } catch (const exception& e) {
+                readError = e.what();
+            }
+            toExtract.push(nullptr, stop);
+        });
+
+        thread extractThread([&] {
+            PagePointer page;
+            while (toExtract.pop(page, stop) && page) {
+                try {
+                    extractDocument(page->batch, *extraction);
+                } catch (const exception& e) {
+                    page->error = e.what();
+                }
+                if (!toWrite.push(move(page), stop)) return;
+            }
+            toWrite.push(nullptr, stop);
+        });
+
+        size_t pages = 0;
+        size_t failed = 0;
+        try {
+            PagePointer page;
+            while (toWrite.pop(page, stop) && page) {
+                pages++;
+                if (!page->error.empty()) {
+                    logger->warning() << "page " << page->number << " (" << page->url << "): " << page->error;
+                    failed++;
+                    continue;
+                }
+                sink.setSource(page->url);
+                for (const auto& product : page->batch.products) {
+                    if (filter && !filter->matches(product)) continue;
+                    if (filter && filter->limit > 0 && passed == filter->limit) break;
+                    sink.write(product);
+                    passed++;
+                }
+                sink.flush();
+            }
+            sink.finish();
+        } catch (...) {
+            // The reader may still be blocked on input; it stops at the next page
+            stop = true;
+            readThread.join();
+            extractThread.join();
+            throw;
+        }
+        readThread.join();
+        extractThread.join();
+
+        if (reader.malformedRecords() > 0) {
+            logger->warning() << "skipped " << reader.malformedRecords() << " lines that were not page records";
+        }
+        if (!readError.empty()) throw runtime_error(readError);
+        logger->info() << "✓ Extracted " << sink.count() << " products from " << pages << " pages ("
+                       << failed << " failed)";
+        if (cache) logger->info() << "Cache: " << cache->summary();
+        return sink.count();
+    }
+
+    // Map a columnar (.pcol) output file and preview its first rows
+    void inspectColumnarFile(const string& filename) {
+        auto started = chrono::steady_clock::now();
+        shared_ptr<const ProductColumns> columns = ProductColumns::open(filename);
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+        cout << "Opened " << columns->size() << " products from " << filename << " in "
+             << fixed << setprecision(2) << millis << " ms" << endl;
+        for (size_t i = 0; i < min(columns->size(), size_t(10)); ++i) {
+            ProductView product = columns->row(i);
+            cout << "\nProduct #" << (i + 1) << ":" << endl;
+            cout << "  Name: " << product.name << endl;
+            cout << "  Price: " << product.price;
+            if (product.amount.valid) {
+                cout << " (" << product.amount.minorUnits / 100 << "." << setw(2) << setfill('0')
+                     << product.amount.minorUnits % 100 << setfill(' ') << " " << currencyCode(product.amount.currency) << ")";
+            }
+            cout << endl;
+            cout << "  Rating: " << product.rating << endl;
+            cout << "  URL: " << product.url << endl;
+        }
+        cout.unsetf(ios::floatfield);
     }
 
     // Main processing function
     void processData(int choice, const string& input, const string& outputFile) {
-        vector<Product> products;
+        // Products borrow their text from the mapped input until written out
+        ProductBatch batch;
+        vector<ProductView>& products = batch.products;
         
         switch (choice) {
             case 1: {
                 // Parse HTML file
-                string html = loadHTMLFromFile(input);
-                if (html.empty()) return;
+                batch.source = loadHTMLFromFile(input);
+                if (!batch.source || batch.source->size() == 0) return;
                 
-                products = extractProducts(html);
+                extractDocument(batch, *rules);
+                if (cache) logger->info() << "Cache: " << cache->summary();
                 if (products.empty()) {
-                    cout << "No products found in HTML file. The file might not contain recognizable e-commerce patterns." << endl;
-                    cout << "Generating sample data instead..." << endl;
-                    products = createSampleData(10);
+                    logger->info() << "No products found in HTML file. The file might not contain recognizable e-commerce patterns.";
+                    logger->info() << "Generating sample data instead...";
+                    for (const auto& product : createSampleData(10)) batch.add(product);
                 }
                 break;
             }
@@ -383,29 +6813,32 @@ public:
                 if (!input.empty()) {
                     count = stoi(input);
                 }
-                products = createSampleData(count);
-                cout << "Generated " << products.size() << " sample products." << endl;
+                for (const auto& product : createSampleData(count)) batch.add(product);
+                logger->info() << "Generated " << products.size() << " sample products.";
                 break;
             }
+            case 4: {
+                // Scrape a directory, glob or manifest in parallel
+                processBatch(collectBatchInputs(input), outputFile);
+                return;
+            }
             default: {
-                cout << "Invalid choice." << endl;
+                logger->error() << "Invalid choice.";
                 return;
             }
         }
         
         if (!products.empty()) {
-            // Save to CSV
-            saveToCSV(products, outputFile);
-            
-            // Also save to JSON
-            string jsonFile = outputFile;
-            size_t dotPos = jsonFile.find_last_of('.');
-            if (dotPos != string::npos) {
-                jsonFile = jsonFile.substr(0, dotPos) + ".json";
-            } else {
-                jsonFile += ".json";
+            // Save to CSV and JSON (or whichever formats were selected)
+            try {
+                unique_ptr<ProductSink> sinks = openOutput(outputFile);
+                if (saveToSink(products, *sinks)) {
+                    logger->info() << "\n✓ Successfully saved " << sinks->count() << " products to "
+                                   << sinks->description();
+                }
+            } catch (const exception& e) {
+                logger->error() << e.what();
             }
-            saveToJSON(products, jsonFile);
             
             // Display sample products
             cout << "\n" << string(80, '=') << endl;
@@ -426,11 +6859,493 @@ public:
         }
     }
 
+    // Microbenchmark of the single-pass cleanText / escapeCSV against the
+    // original regex versions
+    void runTextBenchmark() {
+        const vector<string> fields = {
+            "iPhone 14 Pro Max 128GB Space Black",
+            "$1,099.00",
+            "4.5",
+            "  <b>Samsung</b> Galaxy&nbsp;S23 &amp; Buds\n\t Ultra  ",
+            "<span class=\"a-offscreen\">MacBook Air M2 13-inch</span>",
+            "Sony WH-1000XM4 &quot;Noise Cancelling&quot; Headphones",
+            "Dell XPS 13, Intel i7, 16GB RAM",
+            "https://example-store.com/product/42?ref=list"
+        };
+
+        auto timePerCall = [&](auto&& function, int rounds) {
+            size_t sink = 0;
+            auto started = chrono::steady_clock::now();
+            for (int round = 0; round < rounds; round++) {
+                for (const auto& field : fields) sink += function(field);
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+            if (sink == 0) cout << "";
+            return ns / (static_cast<double>(rounds) * fields.size());
+        };
+
+        bool same = true;
+        for (const auto& field : fields) {
+            same = same && cleanText(field) == cleanTextRegex(field) && escapeCSV(field) == escapeCSVRegex(field);
+        }
+
+        string buffer;
+        double cleanRegex = timePerCall([&](const string& f) { return cleanTextRegex(f).size(); }, 500);
+        double cleanFast = timePerCall([&](const string& f) {
+            buffer.clear();
+            appendCleanText(f, buffer);
+            return buffer.size();
+        }, 200000);
+        double csvRegex = timePerCall([&](const string& f) { return escapeCSVRegex(f).size(); }, 5000);
+        double csvFast = timePerCall([&](const string& f) {
+            buffer.clear();
+            appendCSVField(f, buffer);
+            return buffer.size();
+        }, 200000);
+
+#if defined(__AVX2__)
+        const char* scanner = "AVX2";
+#elif defined(__SSE2__) || defined(_M_X64)
+        const char* scanner = "SSE2";
+#else
+        const char* scanner = "scalar";
+#endif
+
+        cout << "\nText cleaning benchmark (" << fields.size() << " fields, " << scanner << " scan)" << endl;
+        cout << string(60, '-') << endl;
+        cout << fixed << setprecision(1);
+        cout << "cleanText   regex: " << setw(9) << cleanRegex << " ns/call   fast: " << setw(7) << cleanFast
+             << " ns/call   " << cleanRegex / cleanFast << "x" << endl;
+        cout << "escapeCSV   regex: " << setw(9) << csvRegex << " ns/call   fast: " << setw(7) << csvFast
+             << " ns/call   " << csvRegex / csvFast << "x" << endl;
+        cout.unsetf(ios::floatfield);
+        cout << "Outputs identical: " << (same ? "yes" : "NO") << endl;
+    }
+
+    // The regex, token and DOM engines on generated listing pages of the
+    // sizes real catalog pages come in, timed per page. The regex engine
+    // stops at 100 products, and after the first container pattern that
+    // finds 10, so it reports fewer products on pages that mix layouts.
+    // Returns whether the token and DOM engines agreed on every page.
+    bool runEngineBenchmark(uint64_t seed = 42) {
+        const size_t pageSizes[] = {12, 48, 96};
+        bool wasVerbose = verbose;
+        ExtractionEngine wasEngine = engine;
+        verbose = false;
+
+        // Mean time per page over at least a fifth of a second of rounds
+        auto timePerPage = [](auto&& extract) {
+            size_t found = 0, rounds = 0;
+            auto started = chrono::steady_clock::now();
+            double seconds = 0;
+            do {
+                found = extract();
+                rounds++;
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            } while (seconds < 0.2);
+            return make_pair(seconds * 1000.0 / rounds, found);
+        };
+        auto sameProducts = [](const ProductBatch& a, const ProductBatch& b) {
+            if (a.size() != b.size()) return false;
+            for (size_t i = 0; i < a.size(); i++) {
+                const ProductView& x = a.products[i];
+                const ProductView& y = b.products[i];
+                if (x.name != y.name || x.price != y.price || x.rating != y.rating || x.url != y.url) return false;
+            }
+            return true;
+        };
+
+        cout << "\nExtraction engine benchmark (generated listing pages, seed " << seed << ")" << endl;
+        cout << string(90, '-') << endl;
+        cout << right << setw(9) << "products" << setw(9) << "KB" << setw(11) << "regex ms" << setw(11) << "tokens ms"
+             << setw(9) << "dom ms" << setw(13) << "dom/regex" << setw(13) << "dom/tokens" << setw(15) << "found r/t/d"
+             << endl;
+        bool identical = true;
+        for (size_t count : pageSizes) {
+            string page = CatalogGenerator(seed).generate(count);
+            auto regexTime = timePerPage([&] { return extractProductsRegex(page, *rules).size(); });
+
+            ProductBatch tokenBatch, domBatch;
+            auto engineTime = [&](ExtractionEngine which, ProductBatch& batch) {
+                engine = which;
+                return timePerPage([&] {
+                    batch.clear();
+                    extractProducts(page, *rules, batch);
+                    return batch.size();
+                });
+            };
+            auto tokenTime = engineTime(ExtractionEngine::Tokens, tokenBatch);
+            auto domTime = engineTime(ExtractionEngine::Dom, domBatch);
+            identical = identical && sameProducts(tokenBatch, domBatch);
+
+            cout << fixed << setprecision(3) << setw(9) << count << setprecision(1) << setw(9) << page.size() / 1024.0
+                 << setprecision(3) << setw(11) << regexTime.first << setw(11) << tokenTime.first
+                 << setw(9) << domTime.first << setprecision(1)
+                 << setw(12) << regexTime.first / domTime.first << "x"
+                 << setw(12) << tokenTime.first / domTime.first << "x"
+                 << setw(15) << (to_string(regexTime.second) + "/" + to_string(tokenTime.second) + "/" +
+                                 to_string(domTime.second)) << endl;
+        }
+        cout.unsetf(ios::floatfield);
+        cout << "Token and DOM products identical: " << (identical ? "yes" : "NO") << endl;
+
+        engine = wasEngine;
+        verbose = wasVerbose;
+        return identical;
+    }
+
+    // End-to-end benchmark on a generated catalog of productCount products:
+    // generate, load, extract (in memory and streaming) and save, with
+    // throughput, heap allocations and peak RSS for each stage
+    bool runCatalogBenchmark(size_t productCount, uint64_t seed = 42) {
+        namespace fs = std::filesystem;
+        fs::path directory = fs::temp_directory_path() /
+            ("scraper-bench-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+        fs::create_directories(directory);
+        string htmlFile = (directory / "catalog.html").string();
+        string outputFile = (directory / "products.csv").string();
+
+        struct Stage {
+            const char* name;
+            double seconds;
+            size_t bytes;
+            size_t products;
+            uint64_t allocations;
+            size_t peakRss;
+        };
+        vector<Stage> stages;
+        auto measure = [&](const char* name, auto&& body) {
+            uint64_t allocationsBefore = allocstats::count.load();
+            auto started = chrono::steady_clock::now();
+            pair<size_t, size_t> result = body();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            stages.push_back({name, seconds, result.first, result.second,
+                              allocstats::count.load() - allocationsBefore, peakResidentBytes()});
+        };
+
+        bool wasVerbose = verbose;
+        verbose = false;
+        bool wasCounting = allocstats::enabled.exchange(true);
+        size_t extracted = 0, streamed = 0;
+        try {
+            size_t pageBytes = 0;
+            measure("generate", [&] {
+                pageBytes = CatalogGenerator(seed).writeToFile(htmlFile, productCount);
+                return make_pair(pageBytes, productCount);
+            });
+
+            ProductBatch batch;
+            measure("load", [&] {
+                batch.source = HtmlSource::open(htmlFile);
+                return make_pair(batch.source->size(), size_t(0));
+            });
+
+            measure("extract", [&] {
+                extractProducts(batch.source->view(), *rules, batch);
+                extracted = batch.size();
+                return make_pair(pageBytes, extracted);
+            });
+
+            measure("save", [&] {
+                unique_ptr<MultiSink> sinks = openSinks(outputFile, FormatCSV | FormatJSON | FormatNDJSON | FormatColumnar);
+                for (const auto& product : batch.products) sinks->write(product);
+                sinks->finish();
+                size_t outputBytes = 0;
+                for (const char* extension : {".csv", ".json", ".ndjson", ".pcol"}) {
+                    outputBytes += fs::file_size(outputFileWithExtension(outputFile, extension));
+                }
+                return make_pair(outputBytes, sinks->count());
+            });
+            batch.clear();
+
+            // Open the columnar output and scan one numeric and one text column
+            measure("columns", [&] {
+                string columnFile = outputFileWithExtension(outputFile, ".pcol");
+                shared_ptr<const ProductColumns> columns = ProductColumns::open(columnFile);
+                int64_t total = 0;
+                size_t textBytes = 0;
+                for (size_t i = 0; i < columns->size(); i++) {
+                    total += columns->ratingHundredths()[i];
+                    textBytes += columns->name(i).size();
+                }
+                if (total + static_cast<int64_t>(textBytes) == 0) cout << "";
+                return make_pair(fs::file_size(columnFile), columns->size());
+            });
+
+            measure("stream", [&] {
+                ifstream in(htmlFile, ios::binary);
+                streamed = extractProductsStreaming(in, [](const ProductView&) {});
+                return make_pair(pageBytes, streamed);
+            });
+        } catch (const exception& e) {
+            logger->error() << e.what();
+        }
+        allocstats::enabled = wasCounting;
+        verbose = wasVerbose;
+        error_code ignored;
+        fs::remove_all(directory, ignored);
+
+        cout << "\nCatalog benchmark: " << productCount << " products, seed " << seed << ", "
+             << CatalogGenerator::kLayouts << " container layouts" << endl;
+        cout << string(90, '-') << endl;
+        cout << left << setw(10) << "stage" << right << setw(10) << "ms" << setw(11) << "MB/s"
+             << setw(14) << "products/s" << setw(14) << "allocations" << setw(10) << "/product"
+             << setw(15) << "peak RSS MB" << endl;
+        cout << fixed;
+        for (const auto& stage : stages) {
+            double seconds = max(stage.seconds, 1e-9);
+            cout << left << setw(10) << stage.name << right << setprecision(1)
+                 << setw(10) << stage.seconds * 1000.0
+                 << setw(11) << stage.bytes / 1048576.0 / seconds
+                 << setprecision(0) << setw(14) << (stage.products ? stage.products / seconds : 0.0)
+                 << setprecision(3);
+            if (allocstats::available) {
+                cout << setw(14) << stage.allocations
+                     << setw(10) << (stage.products ? static_cast<double>(stage.allocations) / stage.products : 0.0);
+            } else {
+                cout << setw(14) << "-" << setw(10) << "-";
+            }
+            cout << setprecision(1) << setw(15) << stage.peakRss / 1048576.0 << endl;
+        }
+        cout.unsetf(ios::floatfield);
+
+        bool complete = extracted == productCount && streamed == productCount;
+        cout << (complete ? "✓ Every stage recovered all " : "Warning: expected ") << productCount
+             << " products" << (complete ? "" : ", extracted " + to_string(extracted) +
+                                                 ", streamed " + to_string(streamed)) << endl;
+        return complete;
+    }
+
+    // Batch runs over a few files and over five times as many copies of
+    // the same page. processBatch holds a bounded number of files, so the
+    // second run must not raise peak RSS by more than a fraction of the
+    // extra input. Returns false when it does.
+    bool runBatchMemoryCheck(uint64_t seed = 42) {
+        namespace fs = std::filesystem;
+        const size_t fewFiles = 20, manyFiles = 100;
+        fs::path directory = fs::temp_directory_path() /
+            ("scraper-batch-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+        fs::create_directories(directory);
+        string page = (directory / "page.html").string();
+        size_t pageBytes = CatalogGenerator(seed).writeToFile(page, 4000);
+
+        shared_ptr<const Logger> wasLogger = move(logger);
+        shared_ptr<const ProductQuery> wasQuery = move(query);
+        shared_ptr<ExtractionCache> wasCache = move(cache);
+        unsigned wasFormats = formats;
+        logger = Logger::silent();
+        formats = FormatCSV;
+        auto peakAfter = [&](size_t fileCount) {
+            processBatch(vector<string>(fileCount, page), (directory / "products.csv").string());
+            return peakResidentBytes();
+        };
+        size_t fewPeak = 0, manyPeak = 0;
+        try {
+            fewPeak = peakAfter(fewFiles);
+            manyPeak = peakAfter(manyFiles);
+        } catch (const exception& e) {
+            wasLogger->error() << e.what();
+        }
+        formats = wasFormats;
+        cache = move(wasCache);
+        query = move(wasQuery);
+        logger = move(wasLogger);
+        error_code ignored;
+        fs::remove_all(directory, ignored);
+
+        size_t extraBytes = (manyFiles - fewFiles) * pageBytes;
+        size_t growth = manyPeak > fewPeak ? manyPeak - fewPeak : 0;
+        bool flat = manyPeak > 0 && growth < extraBytes / 4;
+        cout << "\nBatch memory: " << fewFiles << " and " << manyFiles << " files of " << fixed << setprecision(1)
+             << pageBytes / 1048576.0 << " MB, peak RSS " << fewPeak / 1048576.0 << " MB -> "
+             << manyPeak / 1048576.0 << " MB (" << (flat ? "flat" : "grows with the file count") << ")" << endl;
+        cout.unsetf(ios::floatfield);
+        return flat;
+    }
+
+    // Check the token and DOM engines against the golden fixtures, then
+    // against each other and the regex engine on `fuzzCases` generated
+    // pages (see "Self-test"). Always uses the built-in rules. Prints the
+    // time each engine takes per fixture; returns false on any difference.
+    bool runSelfTest(size_t fuzzCases, uint64_t seed = 42) {
+        namespace fs = std::filesystem;
+        fs::path directory = fs::temp_directory_path() /
+            ("scraper-selftest-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+        fs::create_directories(directory);
+        const ExtractionRules& extraction = *ExtractionRules::defaults();
+        bool wasVerbose = verbose;
+        ExtractionEngine wasEngine = engine;
+        shared_ptr<const UrlNormalizer> wasNormalizer = move(urlNormalizer);
+        verbose = false;
+        urlNormalizer.reset();
+
+        // The file the CSV or JSON sink writes for `products`
+        auto render = [&](const vector<Product>& products, bool json) {
+            string file = (directory / (json ? "products.json" : "products.csv")).string();
+            unique_ptr<ProductSink> sink;
+            if (json) {
+                sink = make_unique<JsonSink>(file);
+            } else {
+                sink = make_unique<CsvSink>(file);
+            }
+            saveToSink(products, *sink);
+            ifstream in(file, ios::binary);
+            return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        };
+        // Mean microseconds per run over at least a twentieth of a second
+        auto microsPerPage = [](auto&& extract) {
+            size_t rounds = 0;
+            auto started = chrono::steady_clock::now();
+            double seconds = 0;
+            do {
+                extract();
+                rounds++;
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            } while (seconds < 0.05);
+            return seconds * 1e6 / rounds;
+        };
+
+        cout << "\nSelf-test: " << size(kSelfTestFixtures) << " fixtures, built-in rules" << endl;
+        cout << string(90, '-') << endl;
+        cout << left << setw(16) << "fixture" << right << setw(9) << "bytes" << setw(10) << "products"
+             << setw(11) << "tokens us" << setw(9) << "dom us" << setw(10) << "regex us"
+             << setw(13) << "tokens MB/s" << setw(10) << "dom MB/s" << setw(8) << "result" << endl;
+        size_t failedFixtures = 0;
+        ProductBatch batch;
+        for (const SelfTestFixture& fixture : kSelfTestFixtures) {
+            string page = fixture.html;
+            vector<string> problems;
+            engine = ExtractionEngine::Tokens;
+            vector<Product> tokenProducts = extractProducts(page, extraction);
+            engine = ExtractionEngine::Dom;
+            vector<Product> domProducts = extractProducts(page, extraction);
+
+            auto checkGolden = [&](const char* what, const string& actual, const char* golden) {
+                if (golden && actual != golden) {
+                    problems.push_back(string(what) + " differs from the golden output.\nexpected:\n" + golden +
+                                       "actual:\n" + actual);
+                }
+            };
+            checkGolden("token engine CSV", render(tokenProducts, false), fixture.csv);
+            checkGolden("token engine JSON", render(tokenProducts, true), fixture.json);
+            checkGolden("DOM engine CSV", render(domProducts, false), fixture.domCsv ? fixture.domCsv : fixture.csv);
+            if (!fixture.domCsv) checkGolden("DOM engine JSON", render(domProducts, true), fixture.json);
+            if (fixture.regexComparable) {
+                string difference = compareEngines(page, extraction, true);
+                if (!difference.empty()) problems.push_back(difference);
+            }
+
+            auto engineTime = [&](ExtractionEngine which) {
+                engine = which;
+                return microsPerPage([&] {
+                    batch.clear();
+                    extractProducts(page, extraction, batch);
+                });
+            };
+            double tokenMicros = engineTime(ExtractionEngine::Tokens);
+            double domMicros = engineTime(ExtractionEngine::Dom);
+            double regexMicros = microsPerPage([&] { extractProductsRegex(page, extraction); });
+
+            cout << left << setw(16) << fixture.name << right << setw(9) << page.size()
+                 << setw(10) << tokenProducts.size() << fixed << setprecision(1)
+                 << setw(11) << tokenMicros << setw(9) << domMicros << setw(10) << regexMicros
+                 << setw(13) << page.size() / 1.048576 / tokenMicros
+                 << setw(10) << page.size() / 1.048576 / domMicros
+                 << setw(8) << (problems.empty() ? "ok" : "FAIL") << endl;
+            cout.unsetf(ios::floatfield);
+            for (const string& problem : problems) logger->error() << "Fixture " << fixture.name << ": " << problem;
+            if (!problems.empty()) failedFixtures++;
+        }
+
+        // Generated pages; only the first few differences are shown
+        const size_t reportLimit = 5;
+        TestPageGenerator generator(seed);
+        size_t failedPages = 0, products = 0, bytes = 0;
+        auto started = chrono::steady_clock::now();
+        for (size_t i = 0; i < fuzzCases; i++) {
+            string page = generator.page(i);
+            bytes += page.size();
+            string difference = compareEngines(page, extraction, true, &products);
+            if (difference.empty()) continue;
+            if (++failedPages <= reportLimit) {
+                logger->error() << "Generated page " << i << " (seed " << seed << ") differs:\n" << page << difference;
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (fuzzCases > 0) {
+            cout << "Generated pages: " << fuzzCases << " (seed " << seed << "), " << products << " products, "
+                 << bytes << " bytes in " << fixed << setprecision(2) << seconds << " s, "
+                 << failedPages << " with differences" << endl;
+            cout.unsetf(ios::floatfield);
+        }
+
+        urlNormalizer = move(wasNormalizer);
+        engine = wasEngine;
+        verbose = wasVerbose;
+        error_code ignored;
+        fs::remove_all(directory, ignored);
+
+        bool passed = failedFixtures == 0 && failedPages == 0;
+        cout << (passed ? "✓ All engines agree with the golden output and with each other" :
+                          "Self-test failed: " + to_string(failedFixtures) + " fixtures and " +
+                          to_string(failedPages) + " generated pages differ") << endl;
+        return passed;
+    }
+
+    // Differences between the engines on one page, or an empty string: the
+    // token and DOM engines must give the same products in the same order,
+    // and with `withRegex` the regex engine the same set once normalized
+    // (see "Self-test"). Adds the token engine's product count to *found.
+    string compareEngines(const string& page, const ExtractionRules& extraction, bool withRegex,
+                          size_t* found = nullptr) {
+        engine = ExtractionEngine::Tokens;
+        vector<Product> tokenProducts = extractProducts(page, extraction);
+        engine = ExtractionEngine::Dom;
+        vector<Product> domProducts = extractProducts(page, extraction);
+        if (found) *found += tokenProducts.size();
+
+        auto same = [](const vector<Product>& a, const vector<Product>& b) {
+            return equal(a.begin(), a.end(), b.begin(), b.end(), [](const Product& x, const Product& y) {
+                return x.name == y.name && x.price == y.price && x.rating == y.rating && x.url == y.url;
+            });
+        };
+        auto listing = [](const char* engineName, const vector<Product>& products) {
+            string text = string(engineName) + ":\n";
+            for (const Product& p : products) {
+                text += "  " + p.name + " | " + p.price + " | " + p.rating + " | " + p.url + "\n";
+            }
+            if (products.empty()) text += "  (none)\n";
+            return text;
+        };
+        if (!same(tokenProducts, domProducts)) return listing("tokens", tokenProducts) + listing("dom", domProducts);
+        if (!withRegex) return string();
+
+        string flattened = page;
+        for (char& c : flattened) {
+            if (c == '\n' || c == '\r') c = ' ';
+        }
+        vector<Product> regexProducts;
+        unordered_set<uint64_t> seen;
+        for (Product& product : extractProductsRegex(flattened, extraction)) {
+            if (seen.insert(productFingerprint(ProductView(product))).second) regexProducts.push_back(move(product));
+        }
+        auto sorted = [](vector<Product> products) {
+            sort(products.begin(), products.end(), [](const Product& x, const Product& y) {
+                return tie(x.url, x.name, x.price, x.rating) < tie(y.url, y.name, y.price, y.rating);
+            });
+            return products;
+        };
+        if (!same(sorted(tokenProducts), sorted(regexProducts))) {
+            return listing("tokens", tokenProducts) + listing("regex", regexProducts);
+        }
+        return string();
+    }
+
     // Create sample HTML file for testing
     void createSampleHTMLFile(const string& filename) {
         ofstream file(filename);
         if (!file.is_open()) {
-            cerr << "Error: Could not create sample HTML file." << endl;
+            logger->error() << "Could not create sample HTML file.";
             return;
         }
         
@@ -480,11 +7395,217 @@ public:
 </html>)raw";
         
         file.close();
-        cout << "✓ Sample HTML file created: " << filename << endl;
+        logger->info() << "✓ Sample HTML file created: " << filename;
     }
 };
 
-int main() {
+// Parse a numeric flag value into `value`. Returns false, leaving `value`
+// alone, unless the whole text is a non-negative number that fits.
+template <typename T>
+bool parseFlagNumber(const string& text, T& value) {
+    if (text.empty() || !((text[0] >= '0' && text[0] <= '9') || text[0] == '.')) return false;
+    istringstream in(text);
+    T parsed{};
+    if (!(in >> parsed) || in.peek() != char_traits<char>::eof()) return false;
+    value = parsed;
+    return true;
+}
+
+// Non-interactive runs (nothing is read from stdin):
+//   Task4 --input <file.html> [--output products.csv] [--rules FILE]
+//   Task4 --batch <dir|glob|manifest> [--output products.csv] [--threads N] [--rules FILE]
+//   Task4 --stream <file.html> [--output products.csv] [--budget MB] [--rules FILE]
+//   Task4 --pages <-|file> [--page-format auto|ndjson|length] [--output -] [--rules FILE]
+//   Task4 --sample N [--seed S] [--threads N] [--output products.csv]
+//   Task4 --generate <file.html> [--products N] [--seed S]
+//   Task4 --bench [--products N] [--seed S]
+//   Task4 --selftest [--fuzz N] [--seed S]
+//   Task4 --inspect <file.pcol>
+// Every mode that writes products accepts --format csv,json,ndjson,pcol
+// (default csv,json); --input, --batch and --pages accept --cache DIR
+// [--cache-size MB]. --pages reads page records (see PageRecordReader) and
+// writes NDJSON products, to stdout unless --output names a file.
+// --normalize-urls resolves and normalizes product links (see UrlNormalizer);
+// --base-url URL (the URL of --input/--stream pages) and --tracking-params
+// a,b,c* (replacing the built-in list) turn it on as well.
+// --profiles FILE picks per-site rules by page URL (see SiteProfiles): the
+// --pages record URL, or --base-url for the other modes. --profiles-reload
+// SECONDS re-reads the file when it changes, for long-running --pages runs.
+// --where, --sort and --top filter, order and truncate the products written
+// by --input, --batch, --stream and --sample (see ProductQuery). --pages
+// writes each page as it is extracted, so it takes --where and --top but
+// not --sort. Other modes reject all three.
+// --engine dom extracts over a document tree instead of the token list (see
+// DomContainerWalker); rules files may then use css rules. --stream always
+// uses the token engine.
+// --selftest checks both engines against built-in golden pages and against
+// the regex engine on --fuzz N generated pages (default 200); it exits 1 on
+// any difference.
+// --quiet leaves only warnings and errors. Exit status is 0 on success,
+// 1 on failure and 2 for a usage error.
+// Any mode accepts --metrics FILE (or "-" for stderr) to write stage timings
+// and per-rule counters as JSON at exit; SCRAPER_METRICS=FILE does the same.
+int runCommandLine(int argc, char* argv[]) {
+    string inputFile, spec, streamFile, pagesFile, generateFile, inspectFile, rulesFile, formatList = "csv,json";
+    string outputFile, pageFormat = "auto", baseUrl, trackingParams, where, sortKeys, profilesFile, engineChoice;
+    size_t top = 0;
+    double profilesReload = 0;
+    unsigned threadCount = 0;
+    size_t budgetMB = 64;
+    size_t cacheMB = 1024;
+    string cacheDirectory;
+    size_t productCount = 100000;
+    size_t sampleCount = 0;
+    uint64_t seed = 42;
+    size_t fuzzCases = 200;
+    bool bench = false, selfTest = false, quiet = false, normalizeUrls = false, valid = true;
+    for (int i = 1; i < argc && valid; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--input" && hasValue) inputFile = argv[++i];
+        else if (arg == "--batch" && hasValue) spec = argv[++i];
+        else if (arg == "--stream" && hasValue) streamFile = argv[++i];
+        else if (arg == "--pages" && hasValue) pagesFile = argv[++i];
+        else if (arg == "--page-format" && hasValue) pageFormat = argv[++i];
+        else if (arg == "--generate" && hasValue) generateFile = argv[++i];
+        else if (arg == "--bench") bench = true;
+        else if (arg == "--selftest") selfTest = true;
+        else if (arg == "--fuzz" && hasValue) valid = parseFlagNumber(argv[++i], fuzzCases);
+        else if (arg == "--inspect" && hasValue) inspectFile = argv[++i];
+        else if (arg == "--sample" && hasValue) valid = parseFlagNumber(argv[++i], sampleCount);
+        else if (arg == "--output" && hasValue) outputFile = argv[++i];
+        else if (arg == "--threads" && hasValue) valid = parseFlagNumber(argv[++i], threadCount);
+        else if (arg == "--budget" && hasValue) valid = parseFlagNumber(argv[++i], budgetMB);
+        else if (arg == "--rules" && hasValue) rulesFile = argv[++i];
+        else if (arg == "--format" && hasValue) formatList = argv[++i];
+        else if (arg == "--products" && hasValue) valid = parseFlagNumber(argv[++i], productCount);
+        else if (arg == "--seed" && hasValue) valid = parseFlagNumber(argv[++i], seed);
+        else if (arg == "--cache" && hasValue) cacheDirectory = argv[++i];
+        else if (arg == "--cache-size" && hasValue) valid = parseFlagNumber(argv[++i], cacheMB);
+        else if (arg == "--metrics" && hasValue) Metrics::instance().enable(argv[++i]);
+        else if (arg == "--quiet") quiet = true;
+        else if (arg == "--normalize-urls") normalizeUrls = true;
+        else if (arg == "--where" && hasValue) where = argv[++i];
+        else if (arg == "--sort" && hasValue) sortKeys = argv[++i];
+        else if (arg == "--top" && hasValue) valid = parseFlagNumber(argv[++i], top);
+        else if (arg == "--profiles" && hasValue) profilesFile = argv[++i];
+        else if (arg == "--profiles-reload" && hasValue) valid = parseFlagNumber(argv[++i], profilesReload);
+        else if (arg == "--engine" && hasValue) engineChoice = argv[++i];
+        else if (arg == "--base-url" && hasValue) baseUrl = argv[++i], normalizeUrls = true;
+        else if (arg == "--tracking-params" && hasValue) trackingParams = argv[++i], normalizeUrls = true;
+        else valid = false;
+    }
+    int modes = !inputFile.empty() + !spec.empty() + !streamFile.empty() + !pagesFile.empty() + !generateFile.empty() +
+                !inspectFile.empty() + (sampleCount > 0) + bench + selfTest;
+    bool hasQuery = !where.empty() || !sortKeys.empty() || top > 0;
+    if (valid && hasQuery && (!generateFile.empty() || !inspectFile.empty() || bench || selfTest)) {
+        cerr << "Error: --where, --sort and --top only apply to modes that write products" << endl;
+        valid = false;
+    } else if (valid && !sortKeys.empty() && !pagesFile.empty()) {
+        cerr << "Error: --pages writes each page as it arrives and cannot --sort" << endl;
+        valid = false;
+    }
+    if (!valid || modes != 1) {
+        cerr << "Usage: " << argv[0] << " --input <file.html> [--output FILE.csv] [--rules FILE]" << endl;
+        cerr << "       " << argv[0] << " --batch <dir|glob|manifest> [--output FILE.csv] [--threads N] [--rules FILE]" << endl;
+        cerr << "       " << argv[0] << " --stream <file.html> [--output FILE.csv] [--budget MB] [--rules FILE]" << endl;
+        cerr << "       " << argv[0] << " --pages <-|file> [--page-format auto|ndjson|length] [--output FILE.ndjson]" << endl;
+        cerr << "       " << argv[0] << " --sample N [--seed S] [--threads N] [--output FILE.csv]" << endl;
+        cerr << "       " << argv[0] << " --generate <file.html> [--products N] [--seed S]" << endl;
+        cerr << "       " << argv[0] << " --bench [--products N] [--seed S] [--rules FILE]" << endl;
+        cerr << "       " << argv[0] << " --selftest [--fuzz N] [--seed S]" << endl;
+        cerr << "       " << argv[0] << " --inspect <file.pcol>" << endl;
+        cerr << "       options: --format csv,json,ndjson,pcol, --cache DIR, --cache-size MB," << endl;
+        cerr << "                --normalize-urls, --base-url URL, --tracking-params a,b,c*," << endl;
+        cerr << "                --where \"price>=10,rating>=4,name~phone\", --sort -rating,price, --top N," << endl;
+        cerr << "                --profiles FILE, --profiles-reload SECONDS, --engine tokens|dom," << endl;
+        cerr << "                --metrics FILE|-, --quiet" << endl;
+        return 2;
+    }
+
+    bool pagesToStdout = !pagesFile.empty() && (outputFile.empty() || outputFile == "-");
+    if (!pagesFile.empty() && outputFile.empty()) outputFile = "-";
+    if (outputFile.empty()) outputFile = "products.csv";
+    auto logger = make_shared<const Logger>(quiet ? Logger::Warning : Logger::Info, Logger::console(pagesToStdout));
+    try {
+        if (!generateFile.empty()) {
+            size_t bytes = CatalogGenerator(seed).writeToFile(generateFile, productCount);
+            logger->info() << "✓ Generated " << productCount << " products (" << bytes << " bytes) in " << generateFile;
+            return 0;
+        }
+        EcommerceScraper scraper(rulesFile.empty() ? ExtractionRules::defaults() : ExtractionRules::fromFile(rulesFile));
+        if (!rulesFile.empty()) {
+            const ExtractionRules& rules = scraper.extractionRules();
+            logger->info() << "Compiled " << rules.ruleCount() << " extraction rules from " << rules.origin() << " in "
+                           << fixed << setprecision(2) << rules.compileMillis() << " ms";
+        }
+        scraper.setLogger(logger);
+        scraper.setVerbose(false);
+        scraper.setThreads(threadCount);
+        scraper.setOutputFormats(parseOutputFormats(formatList));
+        scraper.setQuery(make_shared<const ProductQuery>(ProductQuery::parse(where, sortKeys, top)));
+        if (!engineChoice.empty()) scraper.setEngine(parseExtractionEngine(engineChoice));
+        if (!profilesFile.empty()) {
+            auto interval = chrono::milliseconds(static_cast<int64_t>(profilesReload * 1000));
+            scraper.setSiteProfiles(make_shared<SiteProfiles>(profilesFile, interval, logger));
+        }
+        if (normalizeUrls) {
+            vector<string> params = UrlNormalizer::defaultTrackingParams();
+            if (!trackingParams.empty()) {
+                params.clear();
+                istringstream list(trackingParams);
+                string param;
+                while (getline(list, param, ',')) {
+                    if (!param.empty()) params.push_back(param);
+                }
+            }
+            scraper.setUrlNormalizer(make_shared<UrlNormalizer>(move(params)));
+            scraper.setBaseUrl(baseUrl);
+        }
+        if (!cacheDirectory.empty()) {
+            scraper.setCache(make_shared<ExtractionCache>(cacheDirectory, static_cast<uint64_t>(cacheMB) << 20));
+        }
+        if (!inputFile.empty()) {
+            scraper.processFile(inputFile, outputFile);
+        } else if (sampleCount > 0) {
+            scraper.setSampleSeed(seed);
+            scraper.processSample(sampleCount, outputFile);
+        } else if (!inspectFile.empty()) {
+            scraper.inspectColumnarFile(inspectFile);
+        } else if (bench) {
+            scraper.runTextBenchmark();
+            bool enginesAgree = scraper.runEngineBenchmark(seed);
+            bool batchFlat = scraper.runBatchMemoryCheck(seed);
+            return scraper.runCatalogBenchmark(productCount, seed) && enginesAgree && batchFlat ? 0 : 1;
+        } else if (selfTest) {
+            return scraper.runSelfTest(fuzzCases, seed) ? 0 : 1;
+        } else if (!streamFile.empty()) {
+            scraper.processStream(streamFile, outputFile, budgetMB << 20);
+        } else if (!pagesFile.empty()) {
+            PageRecordReader::Format format = PageRecordReader::parseFormat(pageFormat);
+            FILE* input = pagesFile == "-" ? stdin : fopen(pagesFile.c_str(), "rb");
+            if (!input) throw runtime_error("Could not open file " + pagesFile);
+            unique_ptr<FILE, int (*)(FILE*)> closer(input == stdin ? nullptr : input, fclose);
+            scraper.processPageStream(input, format, outputFile);
+        } else {
+            scraper.processBatch(scraper.collectBatchInputs(spec), outputFile);
+        }
+    } catch (const exception& e) {
+        logger->error() << e.what();
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (const char* metricsFile = getenv("SCRAPER_METRICS")) {
+        Metrics::instance().enable(metricsFile);
+    }
+
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
+    
     EcommerceScraper scraper;
     
     cout << string(60, '=') << endl;
@@ -494,8 +7615,10 @@ int main() {
     cout << "1. Parse HTML file (recommended)" << endl;
     cout << "2. Generate sample data" << endl;
     cout << "3. Create sample HTML file for testing" << endl;
+    cout << "4. Batch scrape a directory, glob or file list" << endl;
+    cout << "5. Run benchmarks" << endl;
     cout << string(60, '-') << endl;
-    cout << "Enter your choice (1-3): ";
+    cout << "Enter your choice (1-5): ";
     
     int choice;
     cin >> choice;
@@ -514,6 +7637,23 @@ int main() {
         return 0;
     }
     
+    if (choice == 5) {
+        string countText;
+        cout << "Enter number of products for the catalog benchmark (default 100000): ";
+        getline(cin, countText);
+        size_t productCount = 100000;
+        if (!countText.empty() && !parseFlagNumber(countText, productCount)) {
+            cerr << "Warning: '" << countText << "' is not a product count; using 100000." << endl;
+        }
+        
+        scraper.runTextBenchmark();
+        scraper.runEngineBenchmark();
+        scraper.runCatalogBenchmark(productCount);
+        cout << "Press Enter to exit...";
+        cin.get();
+        return 0;
+    }
+    
     string input, outputFile;
     
     switch (choice) {
@@ -525,6 +7665,21 @@ int main() {
                 input = "sample.html";
                 scraper.createSampleHTMLFile(input);
             }
+            
+            string rulesFile;
+            cout << "Enter extraction rules file (blank for built-in rules): ";
+            getline(cin, rulesFile);
+            try {
+                auto rules = rulesFile.empty() ? ExtractionRules::defaults() : ExtractionRules::fromFile(rulesFile);
+                scraper.setRules(rules);
+            } catch (const exception& e) {
+                cerr << "Error: " << e.what() << endl;
+                cout << "Using built-in rules instead." << endl;
+            }
+            const ExtractionRules& rules = scraper.extractionRules();
+            cout << "Compiled " << rules.ruleCount() << " extraction rules from " << rules.origin()
+                 << " in " << fixed << setprecision(2) << rules.compileMillis() << " ms" << endl;
+            cout.unsetf(ios::floatfield);
             break;
         }
         case 2: {
@@ -533,6 +7688,20 @@ int main() {
             if (input.empty()) input = "20";
             break;
         }
+        case 4: {
+            cout << "Enter directory, glob (e.g. pages/*.html) or manifest file: ";
+            getline(cin, input);
+            
+            string threadText;
+            cout << "Enter number of threads (default: all cores): ";
+            getline(cin, threadText);
+            unsigned threadCount = 0;
+            if (!threadText.empty() && !parseFlagNumber(threadText, threadCount)) {
+                cerr << "Warning: '" << threadText << "' is not a thread count; using all cores." << endl;
+            }
+            scraper.setThreads(threadCount);
+            break;
+        }
         default: {
             cout << "Invalid choice. Generating sample data..." << endl;
             choice = 2;